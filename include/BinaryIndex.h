@@ -0,0 +1,45 @@
+#ifndef _DOC2VEC_BINARYINDEX_H_
+#define _DOC2VEC_BINARYINDEX_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+namespace doc2vec {
+  class ThreadPool;
+  struct knn_hit_t;
+
+  // One sign bit per dimension of the rows of a matrix(optionally after a random rotation, which
+  // spreads the variance over the bits). A query counts differing bits with popcount, every worker
+  // keeps the k rows nearest in Hamming distance below its running radius and the merged k are the
+  // candidates of an exact re-rank. Like HnswIndex it keeps no vectors.
+  class BinaryIndex {
+  public:
+    explicit BinaryIndex(size_t dim = 0, bool rotate = false);
+
+    // signatures of rows [size(), rows) of vectors
+    void add(const real * vectors, size_t rows, ThreadPool & pool);
+    // k rows nearest to query in Hamming distance, nearest first, with the cosine the distance
+    // estimates; returns the number of hits
+    size_t search(ThreadPool & pool, const real * query, size_t k, knn_hit_t * hits) const;
+    size_t size() const { return m_rows; }
+    size_t dim() const { return m_dim; }
+
+    void save(FILE * fout) const;
+    void load(FILE * fin);
+
+  private:
+    void signature(const real * vec, uint64_t * bits) const;
+    size_t distance(const uint64_t * a, size_t row) const;
+
+    size_t m_dim;
+    size_t m_words; //64 bit words per signature
+    size_t m_rows = 0;
+    std::vector<real> m_rotation; //dim x dim orthonormal rows, empty without rotation
+    std::vector<uint64_t> m_bits; //rows x words
+  };
+};
+
+#endif
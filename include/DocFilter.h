@@ -0,0 +1,43 @@
+#ifndef _DOC2VEC_DOCFILTER_H_
+#define _DOC2VEC_DOCFILTER_H_
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace doc2vec {
+  // Allowed rows(document ids) of a filtered kNN query: one bit per row in 64 bit words, so the
+  // scans skip whole words, blocks and tiles without an allowed row. Rows past size() are not allowed.
+  class DocFilter {
+  public:
+    explicit DocFilter(size_t rows = 0) : m_rows(rows), m_bits((rows + 63) / 64, 0) { }
+
+    void allow(size_t row) {
+      if (row >= m_rows || allowed(row)) return;
+      m_count++;
+      m_ids.reset();
+      m_bits[row / 64] |= (uint64_t)1 << (row % 64);
+    }
+    bool allowed(size_t row) const { return row < m_rows && (m_bits[row / 64] >> (row % 64) & 1); }
+    // some row of [begin, end) is allowed
+    bool any(size_t begin, size_t end) const;
+    // allowed rows in increasing order, built on first use and kept until the filter changes
+    std::shared_ptr<const std::vector<long long>> ids() const;
+    // rows allowed by both / either filter
+    DocFilter & operator&=(const DocFilter & other);
+    DocFilter & operator|=(const DocFilter & other);
+    size_t count() const { return m_count; }
+    size_t size() const { return m_rows; }
+
+  private:
+    void recount();
+
+    size_t m_rows;
+    size_t m_count = 0;
+    std::vector<uint64_t> m_bits;
+    mutable std::shared_ptr<const std::vector<long long>> m_ids;
+  };
+};
+
+#endif
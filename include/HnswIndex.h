@@ -0,0 +1,65 @@
+#ifndef _DOC2VEC_HNSWINDEX_H_
+#define _DOC2VEC_HNSWINDEX_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <utility>
+#include <cstdio>
+
+namespace doc2vec {
+  class ThreadPool;
+  struct knn_hit_t;
+
+  // Hierarchical navigable small world graph over the rows of a matrix of normalized vectors,
+  // for approximate inner product kNN. The index keeps only the graph, the vectors are passed
+  // to every call and must not change(rows are only appended).
+  class HnswIndex {
+  public:
+    // m: links per node on the upper layers(2m on the bottom one),
+    // ef_construction: candidates explored per insert
+    HnswIndex(size_t dim, size_t m = 16, size_t ef_construction = 100);
+
+    // inserts rows [size(), rows) of vectors in parallel on pool, no search may run meanwhile
+    void add(const real * vectors, size_t rows, ThreadPool & pool);
+    // k most similar rows to query exploring ef(at least k) candidates, most similar first;
+    // returns the number of hits(less than k on small indexes)
+    size_t search(const real * vectors, const real * query, size_t k, size_t ef, knn_hit_t * hits) const;
+    size_t size() const { return m_levels.size(); }
+    size_t dim() const { return m_dim; }
+
+    void save(FILE * fout) const;
+    void load(FILE * fin);
+
+  private:
+    typedef std::pair<real, unsigned int> cand_t; //similarity, row
+
+    void insert(const real * vectors, unsigned int node);
+    unsigned int * links(unsigned int node, int level);
+    const unsigned int * links(unsigned int node, int level) const;
+    // copies the links of node into buf, under the node's lock while inserting
+    size_t neighbours(unsigned int node, int level, unsigned int * buf, bool lock) const;
+    void greedy(const real * vectors, const real * query, cand_t & entry, int level, bool lock) const;
+    // ef most similar nodes reachable from entry on level, most similar first
+    std::vector<cand_t> searchLayer(const real * vectors, const real * query, cand_t entry,
+				    size_t ef, int level, bool lock) const;
+    // up to m of cands(most similar first), skipping those closer to a kept node than to the query
+    void selectNeighbours(const real * vectors, std::vector<cand_t> & cands, size_t m) const;
+    void connect(const real * vectors, unsigned int node, unsigned int link, real similarity, int level);
+
+    size_t m_dim;
+    size_t m_m;
+    size_t m_ef_construction;
+    std::vector<int> m_levels;
+    std::vector<unsigned int> m_links0; //per node: count and 2m links of the bottom layer
+    std::vector<std::vector<unsigned int>> m_upper; //per node: count and m links of each upper layer
+    unsigned int m_entry = 0;
+    int m_max_level = -1;
+    std::mutex m_entry_mutex;
+    std::unique_ptr<std::mutex[]> m_locks; //striped over the nodes
+  };
+};
+
+#endif
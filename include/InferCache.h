@@ -0,0 +1,55 @@
+#ifndef _DOC2VEC_INFERCACHE_H_
+#define _DOC2VEC_INFERCACHE_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+namespace doc2vec {
+  // Bounded LRU cache of inferred document vectors, shared by concurrent inferences.
+  // Keys are word id sequences with the skipped position left out, so a leave-one-out
+  // query and the document without that word share an entry.
+  class InferCache {
+  public:
+    InferCache(size_t capacity, size_t dim);
+
+    // copies the cached vector of ids[0, n) without ids[skip] into vec
+    bool get(const long long * ids, size_t n, long long skip, real * vec);
+    void put(const long long * ids, size_t n, long long skip, const real * vec);
+    void clear();
+
+    unsigned long long hits() const { return m_hits; }
+    unsigned long long misses() const { return m_misses; }
+    size_t capacity() const { return m_capacity; }
+
+  private:
+    struct entry_t {
+      std::vector<long long> ids;
+      std::vector<real> vec;
+    };
+    // entries are spread over shards with a lock each
+    struct shard_t {
+      std::mutex mutex;
+      std::list<entry_t> lru; //most recently used first
+      std::unordered_multimap<size_t, std::list<entry_t>::iterator> index;
+    };
+    static const size_t shards = 16;
+
+    static size_t hash(const long long * ids, size_t n, long long skip);
+    static bool same(const std::vector<long long> & key, const long long * ids, size_t n, long long skip);
+    std::list<entry_t>::iterator find(shard_t & shard, size_t h, const long long * ids, size_t n, long long skip);
+
+    size_t m_capacity;
+    size_t m_shard_capacity;
+    size_t m_dim;
+    std::unique_ptr<shard_t[]> m_shards;
+    std::atomic<unsigned long long> m_hits, m_misses;
+  };
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _DOC2VEC_INFERENCESESSION_H_
+#define _DOC2VEC_INFERENCESESSION_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <memory>
+
+namespace doc2vec {
+  class Model;
+  class TaggedDocument;
+  class TrainModelThread;
+
+  // Reusable state of document inference: scratch buffers, random state and word id buffers.
+  // A session belongs to one thread, once warmed up it infers without heap allocations.
+  class InferenceSession {
+  public:
+    explicit InferenceSession(Model & doc2vec);
+    ~InferenceSession();
+
+    // appends the word ids inference uses for doc: known words up to </s>
+    void resolve(const TaggedDocument & doc, std::vector<long long> & ids) const;
+    // vector of the document ids[0, n), leaving out ids[skip]
+    void infer(const long long * ids, size_t n, real * vec, long long skip = -1);
+    // vector of doc, leaving out doc.m_words[skip]
+    void infer(const TaggedDocument & doc, real * vec, int skip = -1);
+    // infer without the InferCache and without normalizing: the vector at training scale
+    void inferRaw(const long long * ids, size_t n, real * vec, long long skip = -1);
+    // warm start from raw, an inferRaw vector of a similar document(e.g. the full document when
+    // leaving one word out), running only the last passes of the lr schedule; vec is normalized
+    void refine(const long long * ids, size_t n, const real * raw, real * vec, int passes, long long skip = -1);
+    // stop early once a pass changes the vector by less than tolerance(relative to its length),
+    // after min_passes and within max_passes(0 for the model's iter), tolerance 0 runs all passes
+    void setConvergence(real tolerance, int min_passes = 1, int max_passes = 0);
+    // passes run by the last infer, 0 if it came from the model's InferCache
+    int passes() const { return m_passes; }
+
+  private:
+    // runs passes first_pass to iter of the lr schedule on vec
+    void train(const long long * ids, size_t n, long long skip, real * vec, long long first_pass, long long iter);
+    void normalize(real * vec) const;
+
+    Model & m_doc2vec;
+    std::unique_ptr<TrainModelThread> m_thread;
+    std::vector<long long> m_ids;
+    std::unique_ptr<real[]> m_last; //vector before the current pass
+    real m_tolerance = 0;
+    int m_min_passes = 1;
+    int m_max_passes = 0;
+    int m_passes = 0;
+  };
+};
+
+#endif
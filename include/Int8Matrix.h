@@ -0,0 +1,47 @@
+#ifndef _DOC2VEC_INT8MATRIX_H_
+#define _DOC2VEC_INT8MATRIX_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <cstdio>
+
+namespace doc2vec {
+  class ThreadPool;
+  class DocFilter;
+  struct knn_hit_t;
+
+  // Rows of a matrix quantized to int8 with one scale per dimension. A query folds the scales into
+  // its own int8 copy, so scoring a row is an integer dot product over a quarter of the float bytes
+  // (AVX-VNNI/AVX2/SSE2 when the build enables them). The similarities are approximate, callers
+  // re-rank the best rows with the float vectors.
+  class Int8Matrix {
+  public:
+    explicit Int8Matrix(size_t dim = 0);
+
+    // scales from rows [0, rows) of vectors and the codes of those rows
+    void quantize(const real * vectors, size_t rows, ThreadPool * pool = nullptr);
+    // codes of rows [begin, rows) with the current scales(clipped), the matrix grows to rows
+    void update(const real * vectors, size_t begin, size_t rows);
+    // like KnnSearch::search, with the approximate similarities
+    void search(ThreadPool & pool, const real * queries, size_t q, size_t k,
+		knn_hit_t * hits, const long long * exclude = NULL, const DocFilter * filter = NULL) const;
+    size_t size() const { return m_rows; }
+    size_t dim() const { return m_dim; }
+
+    void save(FILE * fout) const;
+    void load(FILE * fin);
+
+  private:
+    // int8 query of scale * code, the per-dimension scales folded in
+    real quantizeQuery(const real * query, signed char * code) const;
+
+    size_t m_dim;
+    size_t m_stride; //bytes per row, dim padded with zeros to a multiple of 32
+    size_t m_rows = 0;
+    std::vector<real> m_scales;
+    std::vector<signed char> m_codes; //rows x stride
+  };
+};
+
+#endif
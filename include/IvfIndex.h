@@ -0,0 +1,45 @@
+#ifndef _DOC2VEC_IVFINDEX_H_
+#define _DOC2VEC_IVFINDEX_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <cstdio>
+
+namespace doc2vec {
+  class ThreadPool;
+  struct knn_hit_t;
+
+  // Inverted file over the rows of a matrix of normalized vectors: k-means centroids and one
+  // posting list of row ids per centroid. A query scans the rows of its nprobe nearest lists.
+  // Like HnswIndex it keeps no vectors, rows can be appended without retraining.
+  class IvfIndex {
+  public:
+    explicit IvfIndex(size_t dim) : m_dim(dim) { }
+
+    // spherical k-means with lists centroids on a sample of the rows, assignments in parallel on pool
+    void train(const real * vectors, size_t rows, size_t lists, int iterations, ThreadPool & pool);
+    // assigns rows [size(), rows) of vectors to their nearest centroid
+    void add(const real * vectors, size_t rows, ThreadPool & pool);
+    // k most similar rows to query among the nprobe nearest lists, most similar first;
+    // returns the number of hits
+    size_t search(const real * vectors, const real * query, size_t k, size_t nprobe, knn_hit_t * hits) const;
+    size_t size() const { return m_rows; }
+    size_t lists() const { return m_lists.size(); }
+    size_t dim() const { return m_dim; }
+
+    void save(FILE * fout) const;
+    void load(FILE * fin);
+
+  private:
+    // index of the centroid nearest to vec
+    size_t nearest(const real * vec) const;
+
+    size_t m_dim;
+    size_t m_rows = 0;
+    std::vector<real> m_centroids; //lists x dim
+    std::vector<std::vector<long long>> m_lists; //row ids per centroid
+  };
+};
+
+#endif
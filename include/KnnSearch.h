@@ -0,0 +1,54 @@
+#ifndef _DOC2VEC_KNNSEARCH_H_
+#define _DOC2VEC_KNNSEARCH_H_
+
+#include <common_define.h>
+
+#include <string_view>
+#include <cstddef>
+
+namespace doc2vec {
+  class ThreadPool;
+  class DocFilter;
+
+  // a nearest neighbour: row index, similarity and a view of its vocabulary entry
+  // (valid until the vocabulary grows)
+  struct knn_hit_t
+  {
+    long long idx = -1;
+    real similarity = 0;
+    std::string_view word;
+  };
+
+  // inner product with SSE/AVX when the build enables them
+  real dot(const real * a, const real * b, size_t dim);
+  // keeps the best k hits in heap(least similar on top), n counts them
+  void hit_push(knn_hit_t * heap, size_t k, size_t & n, long long idx, real similarity);
+  // sorts a heap of n hits, most similar first
+  void hit_sort(knn_hit_t * heap, size_t n);
+
+  // Exact inner product kNN over the rows of a matrix.
+  // Blocks of queries are scored against tiles of rows(a blocked matrix-matrix product),
+  // the tiles are spread over the pool and every worker keeps one top-k heap per query.
+  class KnnSearch {
+  public:
+    KnnSearch(const real * targets, size_t rows, size_t dim)
+      : m_targets(targets), m_rows(rows), m_dim(dim) { }
+    // only rows ids[0, rows) of targets, read in place; hits, exclude and filter use the ids
+    KnnSearch(const real * targets, const long long * ids, size_t rows, size_t dim)
+      : m_targets(targets), m_ids(ids), m_rows(rows), m_dim(dim) { }
+
+    // hits holds q rows of k, most similar first, idx -1 past the available rows;
+    // exclude(if not NULL) holds a row left out per query, -1 for none;
+    // filter(if not NULL) leaves out the rows it doesn't allow and the tiles without any
+    void search(ThreadPool & pool, const real * queries, size_t q, size_t k,
+		knn_hit_t * hits, const long long * exclude = NULL, const DocFilter * filter = NULL) const;
+
+  private:
+    const real * m_targets;
+    const long long * m_ids = nullptr;
+    size_t m_rows;
+    size_t m_dim;
+  };
+};
+
+#endif
@@ -5,29 +5,104 @@
 #include <NN.h>
 #include <WMD.h>
 #include <TaggedBrownCorpus.h>
+#include <ModelAverager.h>
+#include <ThreadPool.h>
+#include <InferCache.h>
+#include <KnnSearch.h>
+#include <HnswIndex.h>
+#include <IvfIndex.h>
+#include <PqIndex.h>
+#include <BinaryIndex.h>
+#include <PcaIndex.h>
+#include <DocFilter.h>
 
 #include <common_define.h>
 
 #include <vector>
 #include <string>
 #include <memory>
+#include <unordered_map>
+#include <thread>
+#include <cmath>
+#include <mutex>
+#include <pthread.h>
 
 namespace doc2vec {
   class TrainModelThread;
   class Input;
   
   struct knn_item_t;
+  struct checkpoint_thread_t;
+
+  // word weights of WMD queries(WeightedDocument)
+  enum wmd_weight_t {
+    WMD_WEIGHT_LOO, // leave-one-out keywords, one inference per word
+    WMD_WEIGHT_IDF, // log((docs + 1) / (df + 1)) per occurrence
+    WMD_WEIGHT_SIF  // a / (a + p(w)) per occurrence
+  };
+
+  // per-query settings of the knn queries, one per index; 0 keeps the model's setting(setHnswEf,
+  // setIvfProbes, setPqRerank, setBinaryRerank)
+  struct search_params_t {
+    size_t hnsw_ef = 0;
+    size_t ivf_probes = 0;
+    size_t pq_rerank = 0;
+    size_t binary_rerank = 0;
+  };
 
   class Model {
     friend class TrainModelThread;  
   public:
     Model();
+    ~Model();
   
     void train(Input & train_file,
 	       size_t dim, bool cbow, bool hs, int negative,
 	       int iter, int window,
 	       real alpha, real sample,
-	       int min_count, int threads);
+	       int min_count, int threads, bool dbow_words = true);
+    // warm start from a trained model: reuse its vocabulary, word vectors and output layer,
+    // and learn document vectors of train_file(word parameters stay fixed if freeze_words)
+    void train(Input & train_file, const Model & base, bool freeze_words,
+	       int iter, real alpha, int threads);
+
+    // appends the documents of input to a trained model and learns their vectors with the word
+    // parameters fixed, tags already in the model are skipped
+    bool add_documents(Input & input, int threads);
+
+    // continued training on train_file: words seen at least min_count times join the vocabulary
+    // (negative sampling only models), new document tags are appended, all parameters learn
+    bool continue_train(Input & train_file, int min_count, int threads);
+
+    // data-parallel training with processes, averaging word parameters after every epoch
+    void setProcesses(int processes) { m_processes = processes; }
+    // write a checkpoint to path every epochs epochs of single process training(0: never)
+    void setCheckpoint(const std::string & path, int epochs) { m_checkpoint_path = path; m_checkpoint_epochs = epochs; }
+    // continue training from a checkpoint written while training on train_file, early stopping
+    // included(its held-out fraction and patience replace those of setEarlyStopping)
+    void resume(Input & train_file, FILE * fin);
+    // hold out a fraction of the documents(their words don't update word parameters) and score them
+    // after every epoch, training ends once their likelihood didn't improve for patience epochs
+    // (hs only, disabled when the word vectors don't train: the score doesn't use document vectors)
+    void setEarlyStopping(real holdout, int patience);
+    int holdoutEvery() const { return m_holdout_every; }
+    int patience() const { return m_patience; }
+    // epochs trained so far, fewer than iter() once early stopping ended the training
+    int epochsDone() const { return m_epochs_done; }
+    // one entry per epoch of the last train or resume(from the checkpointed epoch on), recorded
+    // when the epochs end in step(checkpoints or early stopping)
+    struct epoch_log_t
+    {
+      int epoch;
+      real alpha; //lr of the schedule at the end of the epoch
+      real holdout_likelihood; //per word, 0 without early stopping
+    };
+    const std::vector<epoch_log_t> & epochLog() const { return m_epoch_log; }
+    // worker threads of training and the query paths, created with one worker per core on first use
+    // unless the host application shares its own pool(training adds workers up to its thread count,
+    // queries on the pool keep running next to it)
+    void setThreadPool(std::shared_ptr<ThreadPool> pool) { m_pool = std::move(pool); }
+    ThreadPool & threadPool();
 
     size_t dim() const;
     WMD & wmd() { return *m_wmd; }
@@ -35,25 +110,131 @@ namespace doc2vec {
     const Vocabulary & dvocab() const { return *m_doc_vocab; }
     NN & nn() { return *m_nn; };
     TaggedBrownCorpus & brownCorpus() { return *m_brown_corpus; }
+    // false(with an error message) if the document vectors were left on disk by a compact load / the
+    // word vectors never trained(pure PV-DBOW, also after a reload); the calls needing them return false
+    bool checkDocVectors(const char * what) const;
+    bool checkWordVectors(const char * what) const;
 
     real doc_likelihood(TaggedDocument & doc, int skip = -1);
     real context_likelihood(TaggedDocument & doc, int sentence_position);
+    // doc_likelihood of n documents on the thread pool
+    void doc_likelihoods(TaggedDocument * docs, size_t n, real * likelihoods);
+    // context_likelihood of every position of doc(one per word of doc.m_words) in one pass
+    void context_likelihoods(TaggedDocument & doc, real * likelihoods);
+    // reentrant, concurrent calls only read the model; InferenceSession avoids the per call setup
     void infer_doc(TaggedDocument & doc, real * vec, int skip = -1);
-    bool word_knn_words(const std::string & search, knn_item_t * knns, size_t k);
-    bool doc_knn_docs(const std::string & search, knn_item_t * knns, size_t k);
-    bool word_knn_docs(const std::string & search, knn_item_t * knns, size_t k);
+    // bounded cache of inferred vectors in front of infer_doc/infer_docs/InferenceSession
+    // (default passes only), 0 disables it; cleared whenever the model changes
+    void setInferCache(size_t capacity);
+    InferCache * inferCache() { return m_infer_cache.get(); }
+    // infers n documents on the thread pool, vecs holds n rows of dim()
+    void infer_docs(TaggedDocument * docs, size_t n, real * vecs);
+    // leave-one-out keywords: every distinct known word of doc weighted by 1 - cosine between the
+    // document vector and the vector inferred without it, most important first
+    std::vector<knn_item_t> keywords(TaggedDocument & doc);
+    // the same weight per position of ids; the runs leaving one word out are warm started
+    // from the full document vector and spread over the thread pool
+    void keyword_weights(const long long * ids, size_t n, real * weights);
+    // passes of a warm started leave-one-out run(at most iter)
+    void setKeywordPasses(int passes) { m_keyword_passes = passes; }
+    // closed-form embedding without SGD(SIF): mean of the normalized word vectors weighted by
+    // a / (a + p(w)), minus its projection on the common component of the training documents
+    bool sif_doc(TaggedDocument & doc, real * vec);
+    bool sif_doc(const long long * ids, size_t n, real * vec);
+    // smoothing a of the SIF weights, call before querying
+    void setSifWeight(real a);
+    // weighting of WMD query words, IDF falls back to SIF for models without document frequencies
+    void setWmdWeight(wmd_weight_t weight) { m_wmd_weight = weight; }
+    wmd_weight_t wmdWeight() const { return m_wmd_weight; }
+    // corpus statistics weight of a word for IDF or SIF
+    real wordWeight(long long word_idx, wmd_weight_t weight) const;
+    bool vec_knn_words(const real * vec, knn_item_t * knns, size_t k);
+    bool vec_knn_docs(const real * vec, knn_item_t * knns, size_t k);
+    // batch of q query vectors(q rows of dim()) against the words or the documents, hits holds
+    // q rows of k, most similar first; the words view the vocabulary instead of copying it
+    bool vecs_knn_words(const real * vecs, size_t q, knn_hit_t * hits, size_t k);
+    void vecs_knn_docs(const real * vecs, size_t q, knn_hit_t * hits, size_t k);
+    // int8 copies of the normalized vectors(saved with the model): the exact scans above read them
+    // instead and re-rank their best candidates(at least k) with the float vectors
+    void setInt8(bool enable) { m_nn->quantize(enable, &threadPool()); }
+    void setInt8Rerank(size_t candidates) { m_int8_rerank = candidates; }
+    // copies of the normalized vectors rotated onto their principal axes(saved with the model): the
+    // exact scans above read them block by block and drop rows that can't reach the top k,
+    // dimsRead() of wordPca/docPca tells how much of the rows they read
+    bool buildPca();
+    void dropPca();
+    PcaIndex * wordPca() { return m_word_pca.get(); }
+    PcaIndex * docPca() { return m_doc_pca.get(); }
+    // approximate kNN: HNSW graphs over the normalized word and document vectors, used by the knn
+    // queries below while present; ef of the search is setHnswEf or hnsw_ef of the query's search_params_t
+    bool buildHnsw(size_t m = 16, size_t ef_construction = 100);
+    void saveHnsw(FILE * fout) const;
+    bool loadHnsw(FILE * fin);
+    // back to exact queries
+    void dropHnsw();
+    void setHnswEf(size_t ef) { m_hnsw_ef = ef; }
+    // inverted file over the document vectors(k-means with lists centroids, 0 for sqrt of the corpus
+    // size), used by the document queries without an HNSW index; ivf_probes lists are probed(setIvfProbes)
+    bool buildIvf(size_t lists = 0, int iterations = 10);
+    void saveIvf(FILE * fout) const;
+    bool loadIvf(FILE * fin);
+    void dropIvf() { m_doc_ivf.reset(); }
+    void setIvfProbes(size_t nprobe) { m_ivf_nprobe = nprobe; }
+    // product quantization of the document vectors to m byte codes, scanned by the document
+    // queries without an HNSW or IVF index; pq_rerank candidates are re-ranked with the exact
+    // vectors(setPqRerank, which may be 0 to keep the approximate order)
+    bool buildPq(size_t m, int iterations = 10);
+    void savePq(FILE * fout) const;
+    void loadPq(FILE * fin);
+    void dropPq() { m_doc_pq.reset(); }
+    void setPqRerank(size_t candidates) { m_pq_rerank = candidates; }
+    // sign bits of the normalized word and document vectors(after a random rotation if rotate): the
+    // knn queries without an HNSW, IVF or PQ index take the rows of the smallest Hamming distances
+    // and re-rank them with the vectors; binary_rerank is their number(setBinaryRerank)
+    bool buildBinary(bool rotate = false);
+    void saveBinary(FILE * fout) const;
+    void loadBinary(FILE * fin);
+    void dropBinary();
+    void setBinaryRerank(size_t candidates) { m_binary_rerank = candidates; }
+    // normalized vector of document idx(read from the model file if the model was loaded compact)
+    void doc_vector(long long idx, real * vec) const;
+    // the knn queries fill k items, after the hits of an HNSW or IVF index that found fewer comes idx -1
+    bool word_knn_words(const std::string & search, knn_item_t * knns, size_t k,
+			const search_params_t & params = search_params_t());
+    bool doc_knn_docs(const std::string & search, knn_item_t * knns, size_t k,
+		      const search_params_t & params = search_params_t());
+    bool word_knn_docs(const std::string & search, knn_item_t * knns, size_t k,
+		       const search_params_t & params = search_params_t());
+
+    bool sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector);
+    // returns the number of hits, an index may find fewer than k(the rest of knns has idx -1)
+    size_t sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector,
+			 const search_params_t & params = search_params_t());
 
-    void sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector);
-    void sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector);
+    bool sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k);
+    size_t sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k);
 
-    void sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k);
-    void sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k);
+    // filtered document queries: only documents allowed by filter(rows of dvocab()) come back, the
+    // rest of knns/hits is empty if it allows fewer than k. Small filters(see setFilterDirect) are
+    // scored document by document, larger ones are passed to the exact scans or the PQ codes of a
+    // compact model; the HNSW, IVF and binary indexes are not used
+    bool doc_knn_docs(const std::string & search, const DocFilter & filter, knn_item_t * knns, size_t k);
+    bool word_knn_docs(const std::string & search, const DocFilter & filter, knn_item_t * knns, size_t k);
+    void sent_knn_docs(TaggedDocument & doc, const DocFilter & filter, knn_item_t * knns, size_t k, real * infer_vector);
+    void sent_knn_docs(TaggedDocument & doc, const DocFilter & filter, knn_item_t * knns, size_t k);
+    void vecs_knn_docs(const real * vecs, size_t q, const DocFilter & filter, knn_hit_t * hits, size_t k);
+    // filters allowing at most this fraction of the documents are scored document by document
+    void setFilterDirect(real fraction) { m_filter_direct = fraction; }
+    // documents whose tag starts with prefix, built on first use and cached until the documents change
+    std::shared_ptr<const DocFilter> tagFilter(const std::string & prefix);
   
     real similarity(const real * src, const real * target) const;
     real distance(const real * src, const real * target) const;
 
-    void save(FILE * fout) const;
-    void load(FILE * fin);
+    bool save(FILE * fout) const;
+    // with fpq(written by savePq) the model is loaded compact: the document vectors stay in fin,
+    // queries scan the codes and re-rank from the file; the model can't be saved or trained further
+    void load(FILE * fin, FILE * fpq = NULL);
 
     real getStartAlpha() const { return m_start_alpha; }
     size_t iter() const { return m_iter; }
@@ -66,11 +247,54 @@ namespace doc2vec {
 
   private:
     void initExpTable();
+    void initLogSigmoidTable();
+    real logSigmoid(real x) const {
+      if (x >= MAX_EXP) return -log1p(exp(-x));
+      if (x <= -MAX_EXP) return x - log1p(exp(x));
+      real pos = (x + MAX_EXP) * (EXP_TABLE_SIZE / (real)(2 * MAX_EXP));
+      int i = (int)pos;
+      return m_logSigmoidTable[i] + (pos - i) * (m_logSigmoidTable[i + 1] - m_logSigmoidTable[i]);
+    }
     void initNegTable();
-    void initTrainModelThreads(Input & train_file, int threads, int iter, std::vector<TrainModelThread *> & trainModelThreads);
+    void trainModelThreads(Input & train_file, int threads);
+    void initSchedule();
+    // sets m_train_words to the in-vocabulary words of input, returns its number of documents
+    long long countTrainWords(Input & input);
+    void trainIncrement(Input & input, int threads, bool freeze_words);
+    void addNegTableWords(long long first_word);
+    void trainProcesses(Input & train_file, int threads);
+    // in a forked training process: drop the parent's pool and its lock without destroying them and
+    // build a pool of threads workers
+    void resetAfterFork(int threads);
+    void initTrainModelThreads(Input & train_file, long long seek, long long limit_doc, int threads,
+			       std::vector<TrainModelThread *> & trainModelThreads);
+    void runTrainModelThreads(std::vector<TrainModelThread *> & trainModelThreads);
+    void epochDone(TrainModelThread * thread);
+    void evaluateHoldout();
+    bool isHoldout(long long doc_idx) const { return m_holdout_every > 0 && doc_idx % m_holdout_every == 0; }
+    void writeCheckpoint();
+    void saveParams(FILE * fout) const;
+    void loadParams(FILE * fin);
+    void resetQueryState();
+    real sifWeight(long long word_idx) const;
+    void sifFinish(real * vec);
+    void initSifComponent();
+    // always fills k items of knns: when an HNSW or IVF index finds fewer, the hits come first and the
+    // rest has idx -1(and an empty word), callers walking all k must stop there
     bool obj_knn_objs(const std::string & search, const real * src,
 		      bool search_is_word, bool target_is_word,
-		      knn_item_t * knns, size_t k);
+		      knn_item_t * knns, size_t k, const search_params_t & params = search_params_t(),
+		      const DocFilter * filter = NULL);
+    void vecs_knn_objs(const real * vecs, size_t q, bool target_is_word, const long long * exclude,
+		       knn_hit_t * hits, size_t k, const DocFilter * filter = NULL);
+    // candidates of the PQ codes(documents) or the binary signatures re-ranked by the vectors,
+    // returns the number of hits
+    size_t approx_knn_objs(const real * vec, bool target_is_word, long long exclude,
+			   knn_hit_t * hits, size_t k, const search_params_t & params, const DocFilter * filter = NULL);
+    // the query planner of filtered queries: score the allowed documents one by one
+    bool filterDirect(const DocFilter & filter, size_t k) const;
+    void direct_knn_docs(const real * vecs, size_t q, const long long * exclude, const DocFilter & filter,
+			 knn_hit_t * hits, size_t k);
 
     std::unique_ptr<Vocabulary> m_word_vocab;
     std::unique_ptr<Vocabulary> m_doc_vocab;
@@ -78,28 +302,80 @@ namespace doc2vec {
     std::unique_ptr<WMD> m_wmd;
   
     bool m_cbow = true;
+    bool m_dbow_words = true; //skip-gram only: also train word vectors, otherwise pure PV-DBOW
+    bool m_freeze_words = false; //only document vectors are updated during training
+    long long m_first_train_doc = 0; //documents below keep their vectors(add_documents)
     bool m_hs;
     int m_negative;
     int m_window;
     real m_start_alpha; //fix lr
     real m_sample;
     int m_iter;
+    int m_processes = 1;
 
     //no need to flush to disk
     std::unique_ptr<TaggedBrownCorpus> m_brown_corpus;
     real m_alpha; //working lr
     long long m_word_count_actual;
+    long long m_train_words = 0; //in-vocabulary words per epoch, drives the lr schedule
+    // lr decays linearly from m_lr_alpha to zero between these word counts
+    real m_lr_alpha;
+    long long m_lr_start_words, m_lr_end_words;
+    std::unique_ptr<ModelAverager> m_averager;
+    std::string m_checkpoint_path;
+    int m_checkpoint_epochs = 0;
+    int m_epochs_done = 0;
+    int m_train_iter; //epochs of the running training, shortened by early stopping
+    bool m_epoch_sync = false; //training threads meet at every epoch end
+    int m_holdout_every = 0;
+    int m_patience = 1;
+    int m_holdout_bad_epochs = 0;
+    real m_holdout_best;
+    std::vector<epoch_log_t> m_epoch_log;
+    pthread_barrier_t m_epoch_barrier;
+    std::vector<TrainModelThread *> * m_train_threads = nullptr;
+    std::thread m_checkpoint_writer;
+    std::shared_ptr<ThreadPool> m_pool;
+    std::unique_ptr<std::mutex> m_pool_mutex = std::make_unique<std::mutex>(); //replaced by resetAfterFork
+    std::unique_ptr<InferCache> m_infer_cache;
+    real m_sif_a = 1e-3;
+    int m_keyword_passes = 3;
+    wmd_weight_t m_wmd_weight = WMD_WEIGHT_LOO;
+    std::unique_ptr<HnswIndex> m_word_hnsw;
+    std::unique_ptr<HnswIndex> m_doc_hnsw;
+    size_t m_hnsw_ef = 64;
+    std::unique_ptr<IvfIndex> m_doc_ivf;
+    size_t m_ivf_nprobe = 8;
+    std::unique_ptr<PqIndex> m_doc_pq;
+    size_t m_pq_rerank = 100;
+    size_t m_int8_rerank = 50;
+    std::unique_ptr<PcaIndex> m_word_pca;
+    std::unique_ptr<PcaIndex> m_doc_pca;
+    std::unique_ptr<BinaryIndex> m_word_bits;
+    std::unique_ptr<BinaryIndex> m_doc_bits;
+    size_t m_binary_rerank = 200;
+    real m_filter_direct = 0.25;
+    std::unordered_map<std::string, std::shared_ptr<const DocFilter>> m_tag_filters;
+    std::mutex m_tag_filters_mutex;
+    int m_doc_fd = -1; //model file of a compact load
+    long long m_dsyn0_offset = 0; //document vectors in m_doc_fd
+    std::unique_ptr<std::once_flag> m_sif_once;
+    std::unique_ptr<real[]> m_sif_component; //first principal direction of SIF document embeddings
     std::unique_ptr<real[]> m_expTable;
+    std::unique_ptr<real[]> m_logSigmoidTable;
     std::unique_ptr<int[]> m_negative_sample_table;
+    double m_neg_table_pow = 0; //sum of cn^0.75 the table is built from
   };
 
   struct knn_item_t
   {
     std::string word;
-    long long idx;
-    real similarity;
+    long long idx = -1;
+    real similarity = 0;
   };
   void top_init(knn_item_t * knns, size_t k);
+  // fills knns up to k items(n counts them) and keeps the best k from then on
+  void top_add(knn_item_t * knns, size_t k, size_t & n, long long idx, real similarity);
   void top_collect(knn_item_t * knns, size_t k, long long idx, real similarity);
   void top_sort(knn_item_t * knns, size_t k);
 };
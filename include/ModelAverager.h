@@ -0,0 +1,50 @@
+#ifndef _DOC2VEC_MODELAVERAGER_H_
+#define _DOC2VEC_MODELAVERAGER_H_
+
+#include <common_define.h>
+
+#include <pthread.h>
+#include <cstddef>
+
+namespace doc2vec {
+  class NN;
+
+  // Shared memory of data-parallel training processes.
+  // Every process owns a replica of the word parameters(syn0, syn1, syn1neg) and publishes it
+  // at each epoch end, the replicas are then averaged and copied back into every process.
+  // Document vectors are partition local, each process writes its rows into the shared
+  // document matrix before it exits.
+  class ModelAverager {
+  public:
+    // create before forking the training processes
+    ModelAverager(NN & nn, int processes);
+    ~ModelAverager();
+
+    // in the training process: rank of the process and number of its training threads
+    void attach(int rank, int threads);
+    // called by every training thread of the process at the end of an epoch
+    void epochDone();
+    real * docVector(long long doc_idx) { return m_docs + doc_idx * m_dim; }
+    // in the parent process, after all training processes exited
+    void pull();
+
+  private:
+    void average();
+    void copy(real * dst, bool to_nn);
+
+    NN & m_nn;
+    int m_processes;
+    int m_rank = -1;
+    size_t m_dim;
+    size_t m_params; //size of word parameters of one replica
+    size_t m_map_size;
+    void * m_map;
+    pthread_barrier_t * m_process_barrier;
+    real * m_avg;
+    real * m_replicas;
+    real * m_docs;
+    pthread_barrier_t m_thread_barrier;
+  };
+};
+
+#endif
@@ -2,19 +2,40 @@
 #define _DOC2VEC_NN_H_
 
 #include <common_define.h>
+#include <Int8Matrix.h>
 
 #include <memory>
 #include <cstdio>
 
 namespace doc2vec {
+  class ThreadPool;
+
   class NN {
   public:
-    NN() : m_hs(false), m_negative(false), m_vocab_size(0), m_corpus_size(0), m_dim(0) { }
+    NN() : m_hs(false), m_negative(false), m_vocab_size(0), m_corpus_size(0), m_dim(0), m_syn0_capacity(0), m_dsyn0_capacity(0) { }
     NN(size_t vocab_size, size_t corpus_size, size_t dim, bool hs, int negative);
+    // copy of the trained parameters(without the normalized vectors)
+    NN(const NN & other);
+    // copy word parameters of a trained network, fresh document vectors for corpus_size docs
+    NN(const NN & words, size_t corpus_size);
 
     void save(FILE * fout) const;
-    void load(FILE * fin);
-    void norm();
+    // with dsyn0_offset the document vectors stay on disk: they are skipped and their file
+    // offset stored there
+    void load(FILE * fin, long long * dsyn0_offset = NULL);
+    // normalized copies of the word and(if loaded) document vectors
+    void norm(ThreadPool * pool = nullptr);
+    // appends count random word vectors with zero output weights, storage grows geometrically
+    void addWords(size_t count);
+    // appends count random document vectors, storage grows geometrically
+    void addDocuments(size_t count);
+    // normalizes document vectors from begin on
+    void normDocuments(size_t begin);
+    // int8 copies of the normalized vectors, kept up to date by norm and normDocuments
+    void quantize(bool enable, ThreadPool * pool = nullptr);
+    void saveQuantized(FILE * fout) const;
+    // reads what saveQuantized wrote, nothing at the end of older model files
+    void loadQuantized(FILE * fin);
 
     size_t dim() const { return m_dim; }
     real * get_syn0() { return m_syn0.get(); }
@@ -23,6 +44,8 @@ namespace doc2vec {
     real * get_syn1neg() { return m_syn1neg.get(); }
     const real * get_syn0norm() const { return m_syn0norm.get(); }
     const real * get_dsyn0norm() const { return m_dsyn0norm.get(); }
+    const Int8Matrix * get_syn0q() const { return m_syn0q.get(); }
+    const Int8Matrix * get_dsyn0q() const { return m_dsyn0q.get(); }
   
     bool m_hs;
     int m_negative;
@@ -30,10 +53,13 @@ namespace doc2vec {
 
   private:
     size_t m_dim;
+    size_t m_syn0_capacity; //rows allocated for syn0, syn1 and syn1neg
+    size_t m_dsyn0_capacity; //rows allocated for dsyn0 and dsyn0norm
     std::unique_ptr<real[]> m_syn0, m_dsyn0, m_syn1, m_syn1neg;
 
     // no need to flush to disk
     std::unique_ptr<real[]> m_syn0norm, m_dsyn0norm;
+    std::unique_ptr<Int8Matrix> m_syn0q, m_dsyn0q;
   };
 };
 
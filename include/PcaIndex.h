@@ -0,0 +1,54 @@
+#ifndef _DOC2VEC_PCAINDEX_H_
+#define _DOC2VEC_PCAINDEX_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <atomic>
+#include <cstdio>
+
+namespace doc2vec {
+  class ThreadPool;
+  class DocFilter;
+  struct knn_hit_t;
+
+  // Copies of the rows of a matrix rotated onto their principal axes, most variance first, with the
+  // norm of every row past each block of 16 dimensions. Exact kNN then reads a row block by block
+  // and drops it once the partial dot product plus the Cauchy-Schwarz bound of the rest(query tail
+  // norm times row tail norm) can't beat the worst of the top-k kept so far.
+  class PcaIndex {
+  public:
+    explicit PcaIndex(size_t dim = 0) : m_dim(dim) { }
+
+    // principal axes of(a sample of) the rows, the second moments summed on pool
+    void train(const real * vectors, size_t rows, ThreadPool & pool);
+    // rotated copies of rows [size(), rows) of vectors
+    void add(const real * vectors, size_t rows, ThreadPool & pool);
+    // like KnnSearch::search(queries are not rotated), similarities up to rounding
+    void search(ThreadPool & pool, const real * queries, size_t q, size_t k,
+		knn_hit_t * hits, const long long * exclude = NULL, const DocFilter * filter = NULL) const;
+    // mean dimensions read per query since the last resetStats
+    double dimsRead() const { return m_queries ? m_dims_read / (double)m_queries : 0; }
+    void resetStats() { m_dims_read = 0; m_queries = 0; }
+    size_t size() const { return m_rows; }
+    size_t dim() const { return m_dim; }
+
+    void save(FILE * fout) const;
+    void load(FILE * fin);
+    // moves fin past a saved index without reading it
+    static void skip(FILE * fin);
+
+  private:
+    size_t blocks() const;
+
+    size_t m_dim;
+    size_t m_rows = 0;
+    std::vector<real> m_rotation; //dim x dim, one principal axis per row
+    std::vector<real> m_vectors; //rows x dim, rotated
+    std::vector<real> m_tails; //rows x blocks, norm of a row past each block
+    mutable std::atomic<size_t> m_dims_read{0};
+    mutable std::atomic<size_t> m_queries{0};
+  };
+};
+
+#endif
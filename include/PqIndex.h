@@ -0,0 +1,53 @@
+#ifndef _DOC2VEC_PQINDEX_H_
+#define _DOC2VEC_PQINDEX_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <cstdio>
+
+namespace doc2vec {
+  class ThreadPool;
+  class DocFilter;
+  struct knn_hit_t;
+
+  // Product quantization of the rows of a matrix: the dimensions are split into m subspaces with
+  // 256 k-means centroids each and a row is stored as m one byte centroid ids. A query scores the
+  // codes with a lookup table of its inner products to the centroids(asymmetric distance), the
+  // codes of 8 rows are interleaved per subspace so one load feeds a whole block.
+  // Unlike HnswIndex and IvfIndex it replaces the vectors, search needs only the codes.
+  class PqIndex {
+  public:
+    PqIndex(size_t dim, size_t m = 0) : m_dim(dim), m_m(m) { }
+
+    // k-means per subspace on a sample of the rows, the subspaces in parallel on pool
+    void train(const real * vectors, size_t rows, int iterations, ThreadPool & pool);
+    // encodes rows [size(), rows) of vectors
+    void add(const real * vectors, size_t rows, ThreadPool & pool);
+    // k rows of the highest approximate inner product with query, most similar first(only rows
+    // allowed by filter if not NULL, blocks without any are skipped); returns the number of hits
+    size_t search(ThreadPool & pool, const real * query, size_t k, knn_hit_t * hits,
+		  const DocFilter * filter = NULL) const;
+    // centroids of the codes of row
+    void decode(size_t row, real * vec) const;
+    size_t size() const { return m_rows; }
+    size_t subspaces() const { return m_m; }
+    size_t dim() const { return m_dim; }
+
+    void save(FILE * fout) const;
+    void load(FILE * fin);
+
+  private:
+    size_t begin(size_t s) const { return s * m_dim / m_m; }
+    // centroid of subspace s nearest to the subspace of vec in squared distance
+    unsigned char nearest(size_t s, const real * vec) const;
+
+    size_t m_dim;
+    size_t m_m; //subspaces
+    size_t m_rows = 0;
+    std::vector<real> m_centroids; //256 x subspace dim per subspace, 256 x dim in all
+    std::vector<unsigned char> m_codes; //blocks of 8 rows: m x 8 codes, subspace major
+  };
+};
+
+#endif
@@ -33,6 +33,8 @@ namespace doc2vec {
     void rewind();
     long long tell() { return m_train_file->tell(); }
     long long getDocNum() const { return m_doc_num; }
+    long long getSeek() const { return m_seek; }
+    long long getLimitDoc() const { return m_limit_doc; }
 
   private:
     TaggedDocument m_doc;
@@ -0,0 +1,55 @@
+#ifndef _DOC2VEC_THREADPOOL_H_
+#define _DOC2VEC_THREADPOOL_H_
+
+#include <common_define.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+namespace doc2vec {
+  // Persistent worker threads, shared by training and the query paths of a Model.
+  // Independent parallel_for calls run concurrently: the calling thread works on its own call
+  // and idle workers join whichever call has items left, so calls from a worker don't wait either.
+  class ThreadPool {
+  public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    // worker indices passed by parallel_for stay below size(), fixed for the life of the pool
+    size_t size() const { return m_size; }
+    // run fn(begin, end, worker) on chunks of [0, n) with at least grain items, returns when all are done;
+    // worker is unique among the threads of this call
+    void parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t, size_t)> & fn);
+    // run fn(item) for all n items at once(items may wait for each other, as training threads do),
+    // adding workers up to n; one gang at a time, a gang can't be started from one of its items
+    void gang(size_t n, const std::function<void(size_t)> & fn);
+    // scratch buffer of the calling thread with at least size reals, kept between calls
+    real * scratch(size_t size);
+
+  private:
+    struct job_t {
+      const std::function<void(size_t, size_t, size_t)> * fn;
+      size_t n, chunk, next = 0, pending;
+      size_t workers, joined = 0; //worker indices of the call, handed out on joining
+    };
+    void add(size_t threads);
+    // takes chunks of job until none is left, m_mutex held by lock
+    void drain(job_t & job, std::unique_lock<std::mutex> & lock);
+    void run(job_t & job);
+    void work();
+
+    size_t m_size;
+    std::vector<std::thread> m_workers;
+    std::vector<job_t *> m_jobs; //calls with chunks left, oldest first
+    std::mutex m_gang_mutex; //one gang at a time
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    bool m_stop = false;
+  };
+};
+
+#endif
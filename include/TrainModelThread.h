@@ -14,15 +14,21 @@ namespace doc2vec {
 
   class TrainModelThread {
     friend class Model;
+    friend class InferenceSession;
   public:
     TrainModelThread(long long id, Model * doc2vec,
 		     std::unique_ptr<TaggedBrownCorpus> sub_corpus, bool infer = false);
 
     void train();
+    // scratch of 2 * dim reals for the hidden layer and its error
+    void useScratch(real * scratch);
+    // likelihood of the held-out documents seen by this thread
+    void holdoutLikelihood();
 
   private:
     void updateLR();
     void buildDocument(TaggedDocument & doc, int skip = -1);
+    void buildDocument(const long long * ids, size_t n, long long skip = -1);
     void trainSampleCbow(long long central, long long context_start, long long context_end);
     void trainPairSg(long long central_word, real * context);
     void trainSampleSg(long long central, long long context_start, long long context_end);
@@ -37,17 +43,26 @@ namespace doc2vec {
     Model * m_doc2vec;
     std::unique_ptr<TaggedBrownCorpus> m_corpus;
     bool m_infer;
+    bool m_update_words; //false for inference and frozen word parameters
 
+    int m_local_iter = 0;
     clock_t m_start;
     unsigned long long m_next_random;
+    real m_alpha; //lr of this thread, training threads follow the model's, inference sets its own
 
+    std::vector<long long> m_ids;
     std::vector<long long> m_sen;
     std::vector<long long> m_sen_nosample;
     real * m_doc_vector;
+    long long m_doc_idx = -1;
+    std::vector<std::vector<long long>> m_holdout_docs;
+    real m_holdout_likelihood = 0;
+    long long m_holdout_words = 0;
     long long m_word_count = 0;
     long long m_last_word_count = 0;
-    std::unique_ptr<real[]> m_neu1;
-    std::unique_ptr<real[]> m_neu1e;
+    std::unique_ptr<real[]> m_scratch; //inference only, training threads use the pool's
+    real * m_neu1;
+    real * m_neu1e;
   };
 };
 
@@ -12,9 +12,9 @@ namespace doc2vec {
   class Input;
   
   struct vocab_word_t {
-    vocab_word_t() : cn(0), codelen(0), point(0), code(0) { }
-    vocab_word_t(const std::string & _word, size_t _cn = 1) : word(_word), cn(_cn), codelen(0), point(0), code(0) { }
-    vocab_word_t(const vocab_word_t & other) : word(other.word), cn(other.cn), codelen(other.codelen) {
+    vocab_word_t() : cn(0), df(0), codelen(0), point(0), code(0) { }
+    vocab_word_t(const std::string & _word, size_t _cn = 1) : word(_word), cn(_cn), df(0), codelen(0), point(0), code(0) { }
+    vocab_word_t(const vocab_word_t & other) : word(other.word), cn(other.cn), df(other.df), codelen(other.codelen) {
       point = (int *)malloc(codelen * sizeof(int));
       code = (char *)malloc(codelen * sizeof(char));
       memcpy(point, other.point, codelen * sizeof(int));
@@ -28,6 +28,7 @@ namespace doc2vec {
       if (&other != this) {
 	word = other.word;
 	cn = other.cn;
+	df = other.df;
 	codelen = other.codelen;
       
 	free(point);
@@ -43,6 +44,7 @@ namespace doc2vec {
 
     std::string word; // word string
     size_t cn; // frequency of word
+    size_t df; // number of documents containing the word, 0 if unknown
     char codelen; // Hoffman code length
     int *point; // Huffman tree(n leaf + n inner node, exclude root) path. (root, leaf], node index
     char *code; // Huffman code. (root, leaf], 0/1 codes
@@ -54,10 +56,21 @@ namespace doc2vec {
     Vocabulary(Input & train_file, int min_count = 5, bool doctag = false);
 
     long long searchVocab(const std::string & word) const;
+    // appends the indices of the known words up to </s>, leaving out words[skip]
+    void searchWords(const std::vector<std::string> & words, std::vector<long long> & ids, long long skip = -1) const;
     long long getVocabSize() const { return m_vocab.size(); }
     long long getTrainWords() const { return m_train_words; }
+    // documents the frequencies df were counted on, 0 for models saved without them
+    long long getDocs() const { return m_docs; }
     void save(FILE * fout) const;
     void load(FILE * fin);
+    // appends a word with count cn(words only, it gets no Huffman code), its df is left to countDocuments
+    void addWord(const std::string & word, size_t cn);
+    // document tags only: appends the tags of train_file that are new, returns their number
+    size_t addDocTags(Input & train_file);
+    // words only: counts the documents of train_file whose tag is not in doc_tags, and df of their
+    // words, as loading does; words from first_new on are counted in the other documents too
+    void countDocuments(Input & train_file, const Vocabulary & doc_tags, long long first_new);
   
     size_t size() const { return m_vocab.size(); }
     const std::vector<vocab_word_t> & getWords() const { return m_vocab; }
@@ -73,6 +86,7 @@ namespace doc2vec {
     std::vector<vocab_word_t> m_vocab;
     // total words of corpus. ie. sum up all frequency of words(exculude <s>)
     size_t m_train_words = 0;
+    size_t m_docs = 0;
     // index: hash code of a word, value: vocab index of the word
     std::unordered_map<std::string, size_t> m_vocab_hash;
     int m_min_count;
@@ -5,9 +5,13 @@
 
 #include <limits>
 #include <cstdio>
+#include <functional>
+#include <vector>
 
 namespace doc2vec {
   class TaggedDocument;
+  class TaggedBrownCorpus;
+  class Input;
   class WeightedDocument;
   class UnWeightedDocument;
   class Model;
@@ -20,17 +24,25 @@ namespace doc2vec {
     ~WMD();
     
     void train();
+    // documents of input with index from first_doc on, appended to a trained model
+    void add(Input & input, long long first_doc);
     void save(FILE * fout) const;
     void load(FILE * fin);
     real rwmd(WeightedDocument * src, UnWeightedDocument * target);
-    void sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k);
-    void sent_knn_docs_ex(TaggedDocument & doc, knn_item_t * knns, size_t k);
+    // false if the word vectors of the model never trained(pure PV-DBOW)
+    bool sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k);
+    bool sent_knn_docs_ex(TaggedDocument & doc, knn_item_t * knns, size_t k);
 
   private:
-    void loadFromDoc2Vec();
+    void loadFromDoc2Vec(TaggedBrownCorpus & corpus, long long first_doc);
+    // dis: scratch for one distance per word of src
+    real rwmd(WeightedDocument * src, UnWeightedDocument * target, real * dis);
+    // ranks the targets in parallel, idx(b) maps b to the corpus index
+    void knn_targets(WeightedDocument & src, size_t n, const std::function<long long(size_t)> & idx,
+      knn_item_t * knns, size_t k);
 
   public:
-    UnWeightedDocument ** m_corpus;
+    std::vector<UnWeightedDocument *> m_corpus;
 
     Model * m_doc2vec;
     knn_item_t * m_doc2vec_knns;
@@ -0,0 +1,148 @@
+#include <BinaryIndex.h>
+#include <KnnSearch.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <cmath>
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+#include <immintrin.h>
+#endif
+
+using namespace doc2vec;
+
+BinaryIndex::BinaryIndex(size_t dim, bool rotate)
+  : m_dim(dim), m_words((dim + 63) / 64)
+{
+  if (!rotate) return;
+  // Gram-Schmidt on gaussian rows gives a random orthonormal basis
+  m_rotation.resize(dim * dim);
+  unsigned long long next_random = 1;
+  for (size_t a = 0; a < dim * dim; a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    double u1 = (((next_random >> 16) & 0xFFFF) + 1) / 65537.0;
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    double u2 = ((next_random >> 16) & 0xFFFF) / 65536.0;
+    m_rotation[a] = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+  }
+  for (size_t a = 0; a < dim; a++) {
+    real * row = &m_rotation[a * dim];
+    for (size_t b = 0; b < a; b++) {
+      const real * prev = &m_rotation[b * dim];
+      real proj = dot(row, prev, dim);
+      for (size_t d = 0; d < dim; d++) row[d] -= proj * prev[d];
+    }
+    real len = sqrt(dot(row, row, dim));
+    for (size_t d = 0; d < dim; d++) row[d] /= len;
+  }
+}
+
+void BinaryIndex::signature(const real * vec, uint64_t * bits) const
+{
+  std::fill(bits, bits + m_words, 0);
+  for (size_t d = 0; d < m_dim; d++) {
+    real x = m_rotation.empty() ? vec[d] : dot(&m_rotation[d * m_dim], vec, m_dim);
+    if (x > 0) bits[d / 64] |= (uint64_t)1 << (d % 64);
+  }
+}
+
+// POPCNT when the build enables it, otherwise the bit-parallel count(gcc would call libgcc)
+static inline size_t popcount(uint64_t x)
+{
+#if defined(__POPCNT__)
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+size_t BinaryIndex::distance(const uint64_t * a, size_t row) const
+{
+  const uint64_t * b = &m_bits[row * m_words];
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+  __m512i acc = _mm512_setzero_si512();
+  for (size_t w = 0; w < m_words; w += 8) {
+    __mmask8 mask = m_words - w >= 8 ? 0xFF : (1 << (m_words - w)) - 1;
+    __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, a + w), _mm512_maskz_loadu_epi64(mask, b + w));
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+  }
+  return _mm512_reduce_add_epi64(acc);
+#else
+  size_t f = 0;
+  for (size_t w = 0; w < m_words; w++) f += popcount(a[w] ^ b[w]);
+  return f;
+#endif
+}
+
+void BinaryIndex::add(const real * vectors, size_t rows, ThreadPool & pool)
+{
+  if (rows <= m_rows) return;
+  size_t first = m_rows;
+  m_bits.resize(rows * m_words);
+  pool.parallel_for(rows - first, 1024, [&](size_t begin, size_t end, size_t) {
+    for (size_t a = first + begin; a < first + end; a++) signature(vectors + a * m_dim, &m_bits[a * m_words]);
+  });
+  m_rows = rows;
+}
+
+size_t BinaryIndex::search(ThreadPool & pool, const real * query, size_t k, knn_hit_t * hits) const
+{
+  k = std::min(k, m_rows);
+  if (k == 0) return 0;
+  std::vector<uint64_t> code(m_words);
+  signature(query, code.data());
+  // every worker keeps its k nearest(ties by row) in a max heap, the root is its running radius
+  size_t workers = pool.size();
+  std::vector<std::vector<std::pair<size_t, long long>>> found(workers);
+  pool.parallel_for(m_rows, 4096, [&](size_t begin, size_t end, size_t worker) {
+    auto & heap = found[worker];
+    heap.reserve(k);
+    for (size_t r = begin; r < end; r++) {
+      size_t d = distance(code.data(), r);
+      if (heap.size() == k) {
+	if (std::make_pair(d, (long long)r) >= heap[0]) continue;
+	std::pop_heap(heap.begin(), heap.end());
+	heap.pop_back();
+      }
+      heap.push_back(std::make_pair(d, r));
+      std::push_heap(heap.begin(), heap.end());
+    }
+  });
+  std::vector<std::pair<size_t, long long>> all;
+  for (auto & f : found) all.insert(all.end(), f.begin(), f.end());
+  std::partial_sort(all.begin(), all.begin() + k, all.end());
+  for (size_t a = 0; a < k; a++) {
+    hits[a].idx = all[a].second;
+    hits[a].similarity = cos(M_PI * std::min(all[a].first, m_dim) / m_dim);
+  }
+  return k;
+}
+
+void BinaryIndex::save(FILE * fout) const
+{
+  long long dim = m_dim, rows = m_rows;
+  int rotate = !m_rotation.empty();
+  fwrite(&dim, sizeof(long long), 1, fout);
+  fwrite(&rows, sizeof(long long), 1, fout);
+  fwrite(&rotate, sizeof(int), 1, fout);
+  fwrite(m_rotation.data(), sizeof(real), m_rotation.size(), fout);
+  fwrite(m_bits.data(), sizeof(uint64_t), m_bits.size(), fout);
+}
+
+void BinaryIndex::load(FILE * fin)
+{
+  long long dim, rows;
+  int rotate;
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&rows, sizeof(long long), 1, fin);
+  fread(&rotate, sizeof(int), 1, fin);
+  m_dim = dim;
+  m_words = (m_dim + 63) / 64;
+  m_rows = rows;
+  m_rotation.resize(rotate ? m_dim * m_dim : 0);
+  fread(m_rotation.data(), sizeof(real), m_rotation.size(), fin);
+  m_bits.resize(m_rows * m_words);
+  fread(m_bits.data(), sizeof(uint64_t), m_bits.size(), fin);
+}
@@ -0,0 +1,56 @@
+#include <DocFilter.h>
+
+#include <algorithm>
+
+using namespace doc2vec;
+
+bool DocFilter::any(size_t begin, size_t end) const
+{
+  end = std::min(end, m_rows);
+  if (begin >= end) return false;
+  size_t first = begin / 64, last = (end - 1) / 64;
+  uint64_t head = ~(uint64_t)0 << (begin % 64), tail = ~(uint64_t)0 >> (63 - (end - 1) % 64);
+  if (first == last) return m_bits[first] & head & tail;
+  if (m_bits[first] & head) return true;
+  for (size_t w = first + 1; w < last; w++) if (m_bits[w]) return true;
+  return m_bits[last] & tail;
+}
+
+std::shared_ptr<const std::vector<long long>> DocFilter::ids() const
+{
+  // concurrent queries may build it at once, either copy is kept
+  auto cached = std::atomic_load(&m_ids);
+  if (cached) return cached;
+  auto rows = std::make_shared<std::vector<long long>>();
+  rows->reserve(m_count);
+  for (size_t w = 0; w < m_bits.size(); w++) {
+    for (uint64_t bits = m_bits[w]; bits; bits &= bits - 1) rows->push_back(w * 64 + __builtin_ctzll(bits));
+  }
+  cached = rows;
+  std::atomic_store(&m_ids, cached);
+  return cached;
+}
+
+DocFilter & DocFilter::operator&=(const DocFilter & other)
+{
+  for (size_t w = 0; w < m_bits.size(); w++) m_bits[w] &= w < other.m_bits.size() ? other.m_bits[w] : 0; //other may be shorter
+  recount();
+  return *this;
+}
+
+DocFilter & DocFilter::operator|=(const DocFilter & other)
+{
+  size_t words = std::min(m_bits.size(), other.m_bits.size());
+  for (size_t w = 0; w < words; w++) m_bits[w] |= other.m_bits[w];
+  // other's rows past size() stay out
+  if (other.m_rows > m_rows && m_rows % 64) m_bits[m_rows / 64] &= ~(~(uint64_t)0 << (m_rows % 64));
+  recount();
+  return *this;
+}
+
+void DocFilter::recount()
+{
+  m_ids.reset();
+  m_count = 0;
+  for (uint64_t bits : m_bits) m_count += __builtin_popcountll(bits);
+}
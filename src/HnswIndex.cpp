@@ -0,0 +1,262 @@
+#include <HnswIndex.h>
+#include <KnnSearch.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <cmath>
+
+using namespace doc2vec;
+
+static const size_t LOCKS = 4096;
+static const int MAX_LEVEL = 16;
+
+// visit marks of the searches on this thread, a search bumps the epoch instead of clearing them
+static thread_local std::vector<unsigned int> visit_marks;
+static thread_local unsigned int visit_epoch = 0;
+
+static unsigned int nextEpoch(size_t nodes)
+{
+  if (visit_marks.size() < nodes) visit_marks.resize(nodes, 0);
+  if (++visit_epoch == 0) {
+    std::fill(visit_marks.begin(), visit_marks.end(), 0);
+    visit_epoch = 1;
+  }
+  return visit_epoch;
+}
+
+HnswIndex::HnswIndex(size_t dim, size_t m, size_t ef_construction)
+  : m_dim(dim), m_m(m), m_ef_construction(ef_construction), m_locks(new std::mutex[LOCKS])
+{
+}
+
+unsigned int * HnswIndex::links(unsigned int node, int level)
+{
+  if (level == 0) return &m_links0[node * (2 * m_m + 1)];
+  return &m_upper[node][(level - 1) * (m_m + 1)];
+}
+
+const unsigned int * HnswIndex::links(unsigned int node, int level) const
+{
+  return const_cast<HnswIndex *>(this)->links(node, level);
+}
+
+size_t HnswIndex::neighbours(unsigned int node, int level, unsigned int * buf, bool lock) const
+{
+  const unsigned int * l = links(node, level);
+  if (!lock) {
+    std::copy(l + 1, l + 1 + l[0], buf);
+    return l[0];
+  }
+  std::lock_guard<std::mutex> guard(m_locks[node % LOCKS]);
+  std::copy(l + 1, l + 1 + l[0], buf);
+  return l[0];
+}
+
+void HnswIndex::add(const real * vectors, size_t rows, ThreadPool & pool)
+{
+  size_t first = m_levels.size();
+  if (rows <= first) return;
+  // levels are drawn up front so every node has its link storage before it is reachable
+  m_levels.resize(rows);
+  m_links0.resize(rows * (2 * m_m + 1), 0);
+  m_upper.resize(rows);
+  double ml = 1 / log((double)std::max(m_m, (size_t)2));
+  unsigned long long next_random = 1 + first;
+  for (size_t a = first; a < rows; a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    double u = ((next_random >> 16) & 0xFFFFFFFF) / 4294967296.0;
+    int level = (int)(-log(1 - u) * ml);
+    m_levels[a] = std::min(level, MAX_LEVEL);
+    if (m_levels[a] > 0) m_upper[a].assign(m_levels[a] * (m_m + 1), 0);
+  }
+  if (m_max_level < 0) {
+    m_entry = first;
+    m_max_level = m_levels[first];
+    first++;
+  }
+  pool.parallel_for(rows - first, 64, [&](size_t begin, size_t end, size_t) {
+    for (size_t a = begin; a < end; a++) insert(vectors, first + a);
+  });
+}
+
+void HnswIndex::insert(const real * vectors, unsigned int node)
+{
+  const real * query = vectors + (size_t)node * m_dim;
+  int level = m_levels[node];
+  cand_t entry;
+  int max_level;
+  {
+    std::lock_guard<std::mutex> guard(m_entry_mutex);
+    entry.second = m_entry;
+    max_level = m_max_level;
+  }
+  entry.first = dot(query, vectors + (size_t)entry.second * m_dim, m_dim);
+  for (int l = max_level; l > level; l--) greedy(vectors, query, entry, l, true);
+  for (int l = std::min(level, max_level); l >= 0; l--) {
+    std::vector<cand_t> found = searchLayer(vectors, query, entry, m_ef_construction, l, true);
+    entry = found[0];
+    found.erase(std::remove_if(found.begin(), found.end(), [node](const cand_t & c) { return c.second == node; }),
+		found.end());
+    selectNeighbours(vectors, found, m_m);
+    {
+      std::lock_guard<std::mutex> guard(m_locks[node % LOCKS]);
+      unsigned int * own = links(node, l);
+      own[0] = found.size();
+      for (size_t a = 0; a < found.size(); a++) own[a + 1] = found[a].second;
+    }
+    for (auto & c : found) connect(vectors, c.second, node, c.first, l);
+  }
+  if (level > max_level) {
+    std::lock_guard<std::mutex> guard(m_entry_mutex);
+    if (level > m_max_level) {
+      m_max_level = level;
+      m_entry = node;
+    }
+  }
+}
+
+void HnswIndex::connect(const real * vectors, unsigned int node, unsigned int link, real similarity, int level)
+{
+  size_t max = level == 0 ? 2 * m_m : m_m;
+  std::lock_guard<std::mutex> guard(m_locks[node % LOCKS]);
+  unsigned int * l = links(node, level);
+  if (l[0] < max) {
+    l[++l[0]] = link;
+    return;
+  }
+  // full: keep the most diverse of the old links and the new one
+  const real * vec = vectors + (size_t)node * m_dim;
+  std::vector<cand_t> cands(1, cand_t(similarity, link));
+  for (unsigned int a = 1; a <= l[0]; a++) {
+    cands.push_back(cand_t(dot(vec, vectors + (size_t)l[a] * m_dim, m_dim), l[a]));
+  }
+  std::sort(cands.begin(), cands.end(), std::greater<cand_t>());
+  selectNeighbours(vectors, cands, max);
+  l[0] = cands.size();
+  for (size_t a = 0; a < cands.size(); a++) l[a + 1] = cands[a].second;
+}
+
+void HnswIndex::selectNeighbours(const real * vectors, std::vector<cand_t> & cands, size_t m) const
+{
+  if (cands.size() <= m) return;
+  std::vector<cand_t> kept;
+  for (auto & c : cands) {
+    if (kept.size() >= m) break;
+    const real * vec = vectors + (size_t)c.second * m_dim;
+    bool diverse = true;
+    for (auto & k : kept) {
+      if (dot(vec, vectors + (size_t)k.second * m_dim, m_dim) > c.first) {
+	diverse = false;
+	break;
+      }
+    }
+    if (diverse) kept.push_back(c);
+  }
+  cands.swap(kept);
+}
+
+void HnswIndex::greedy(const real * vectors, const real * query, cand_t & entry, int level, bool lock) const
+{
+  std::vector<unsigned int> buf(2 * m_m);
+  bool moved = true;
+  while (moved) {
+    moved = false;
+    size_t n = neighbours(entry.second, level, buf.data(), lock);
+    for (size_t a = 0; a < n; a++) {
+      real s = dot(query, vectors + (size_t)buf[a] * m_dim, m_dim);
+      if (s > entry.first) {
+	entry = cand_t(s, buf[a]);
+	moved = true;
+      }
+    }
+  }
+}
+
+std::vector<HnswIndex::cand_t> HnswIndex::searchLayer(const real * vectors, const real * query, cand_t entry,
+						      size_t ef, int level, bool lock) const
+{
+  unsigned int epoch = nextEpoch(m_levels.size());
+  std::vector<unsigned int> buf(2 * m_m);
+  std::priority_queue<cand_t> candidates; //most similar on top
+  std::priority_queue<cand_t, std::vector<cand_t>, std::greater<cand_t>> found; //least similar on top
+  candidates.push(entry);
+  found.push(entry);
+  visit_marks[entry.second] = epoch;
+  while (!candidates.empty()) {
+    cand_t c = candidates.top();
+    if (found.size() >= ef && c.first < found.top().first) break;
+    candidates.pop();
+    size_t n = neighbours(c.second, level, buf.data(), lock);
+    for (size_t a = 0; a < n; a++) {
+      unsigned int id = buf[a];
+      if (visit_marks[id] == epoch) continue;
+      visit_marks[id] = epoch;
+      real s = dot(query, vectors + (size_t)id * m_dim, m_dim);
+      if (found.size() < ef || s > found.top().first) {
+	candidates.push(cand_t(s, id));
+	found.push(cand_t(s, id));
+	if (found.size() > ef) found.pop();
+      }
+    }
+  }
+  std::vector<cand_t> result(found.size());
+  for (size_t a = result.size(); a > 0; a--) {
+    result[a - 1] = found.top();
+    found.pop();
+  }
+  return result;
+}
+
+size_t HnswIndex::search(const real * vectors, const real * query, size_t k, size_t ef, knn_hit_t * hits) const
+{
+  if (m_max_level < 0 || k == 0) return 0;
+  cand_t entry(dot(query, vectors + (size_t)m_entry * m_dim, m_dim), m_entry);
+  for (int l = m_max_level; l > 0; l--) greedy(vectors, query, entry, l, false);
+  std::vector<cand_t> found = searchLayer(vectors, query, entry, std::max(ef, k), 0, false);
+  size_t n = std::min(k, found.size());
+  for (size_t a = 0; a < n; a++) {
+    hits[a].idx = found[a].second;
+    hits[a].similarity = found[a].first;
+  }
+  return n;
+}
+
+void HnswIndex::save(FILE * fout) const
+{
+  long long size = m_levels.size(), m = m_m, ef = m_ef_construction, dim = m_dim;
+  fwrite(&size, sizeof(long long), 1, fout);
+  fwrite(&dim, sizeof(long long), 1, fout);
+  fwrite(&m, sizeof(long long), 1, fout);
+  fwrite(&ef, sizeof(long long), 1, fout);
+  fwrite(&m_entry, sizeof(unsigned int), 1, fout);
+  fwrite(&m_max_level, sizeof(int), 1, fout);
+  fwrite(m_levels.data(), sizeof(int), size, fout);
+  fwrite(m_links0.data(), sizeof(unsigned int), m_links0.size(), fout);
+  for (auto & upper : m_upper) fwrite(upper.data(), sizeof(unsigned int), upper.size(), fout);
+}
+
+void HnswIndex::load(FILE * fin)
+{
+  long long size, m, ef, dim;
+  fread(&size, sizeof(long long), 1, fin);
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&m, sizeof(long long), 1, fin);
+  fread(&ef, sizeof(long long), 1, fin);
+  m_dim = dim;
+  m_m = m;
+  m_ef_construction = ef;
+  fread(&m_entry, sizeof(unsigned int), 1, fin);
+  fread(&m_max_level, sizeof(int), 1, fin);
+  m_levels.resize(size);
+  fread(m_levels.data(), sizeof(int), size, fin);
+  m_links0.resize(size * (2 * m_m + 1));
+  fread(m_links0.data(), sizeof(unsigned int), m_links0.size(), fin);
+  m_upper.assign(size, std::vector<unsigned int>());
+  for (long long a = 0; a < size; a++) {
+    if (m_levels[a] == 0) continue;
+    m_upper[a].resize(m_levels[a] * (m_m + 1));
+    fread(m_upper[a].data(), sizeof(unsigned int), m_upper[a].size(), fin);
+  }
+}
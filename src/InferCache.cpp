@@ -0,0 +1,91 @@
+#include <InferCache.h>
+
+#include <algorithm>
+
+using namespace doc2vec;
+
+InferCache::InferCache(size_t capacity, size_t dim)
+  : m_capacity(capacity), m_shard_capacity(std::max(capacity / shards, (size_t)1)), m_dim(dim),
+    m_shards(new shard_t[shards]), m_hits(0), m_misses(0)
+{
+}
+
+size_t InferCache::hash(const long long * ids, size_t n, long long skip)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t a = 0; a < n; a++) {
+    if ((long long)a == skip) continue;
+    h = (h ^ (unsigned long long)ids[a]) * 1099511628211ULL;
+  }
+  return h ^ (h >> 29);
+}
+
+bool InferCache::same(const std::vector<long long> & key, const long long * ids, size_t n, long long skip)
+{
+  size_t len = skip >= 0 && skip < (long long)n ? n - 1 : n;
+  if (key.size() != len) return false;
+  for (size_t a = 0, b = 0; a < n; a++) {
+    if ((long long)a == skip) continue;
+    if (key[b++] != ids[a]) return false;
+  }
+  return true;
+}
+
+std::list<InferCache::entry_t>::iterator InferCache::find(shard_t & shard, size_t h,
+							   const long long * ids, size_t n, long long skip)
+{
+  auto range = shard.index.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (same(it->second->ids, ids, n, skip)) return it->second;
+  }
+  return shard.lru.end();
+}
+
+bool InferCache::get(const long long * ids, size_t n, long long skip, real * vec)
+{
+  size_t h = hash(ids, n, skip);
+  shard_t & shard = m_shards[h % shards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = find(shard, h, ids, n, skip);
+  if (it == shard.lru.end()) {
+    m_misses++;
+    return false;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it);
+  std::copy(it->vec.begin(), it->vec.end(), vec);
+  m_hits++;
+  return true;
+}
+
+void InferCache::put(const long long * ids, size_t n, long long skip, const real * vec)
+{
+  size_t h = hash(ids, n, skip);
+  shard_t & shard = m_shards[h % shards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (find(shard, h, ids, n, skip) != shard.lru.end()) return;
+  entry_t entry;
+  for (size_t a = 0; a < n; a++) if ((long long)a != skip) entry.ids.push_back(ids[a]);
+  entry.vec.assign(vec, vec + m_dim);
+  shard.lru.push_front(std::move(entry));
+  shard.index.emplace(h, shard.lru.begin());
+  if (shard.lru.size() > m_shard_capacity) {
+    auto last = std::prev(shard.lru.end());
+    auto range = shard.index.equal_range(hash(last->ids.data(), last->ids.size(), -1));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == last) {
+	shard.index.erase(it);
+	break;
+      }
+    }
+    shard.lru.pop_back();
+  }
+}
+
+void InferCache::clear()
+{
+  for (size_t s = 0; s < shards; s++) {
+    std::lock_guard<std::mutex> lock(m_shards[s].mutex);
+    m_shards[s].lru.clear();
+    m_shards[s].index.clear();
+  }
+}
@@ -0,0 +1,109 @@
+#include <InferenceSession.h>
+#include <TrainModelThread.h>
+#include <TaggedBrownCorpus.h>
+#include <Vocabulary.h>
+#include <Model.h>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace doc2vec;
+
+InferenceSession::InferenceSession(Model & doc2vec)
+  : m_doc2vec(doc2vec), m_thread(new TrainModelThread(0, &doc2vec, NULL, true)),
+    m_last(new real[doc2vec.dim()])
+{
+}
+
+InferenceSession::~InferenceSession() { }
+
+void InferenceSession::resolve(const TaggedDocument & doc, std::vector<long long> & ids) const
+{
+  m_doc2vec.wvocab().searchWords(doc.m_words, ids);
+}
+
+void InferenceSession::setConvergence(real tolerance, int min_passes, int max_passes)
+{
+  m_tolerance = tolerance;
+  m_min_passes = min_passes;
+  m_max_passes = max_passes;
+}
+
+void InferenceSession::infer(const long long * ids, size_t n, real * vec, long long skip)
+{
+  // cached vectors come from the default number of passes
+  InferCache * cache = m_tolerance > 0 || m_max_passes > 0 ? nullptr : m_doc2vec.inferCache();
+  if (cache && cache->get(ids, n, skip, vec)) {
+    m_passes = 0;
+    return;
+  }
+  inferRaw(ids, n, vec, skip);
+  normalize(vec);
+  if (cache) cache->put(ids, n, skip, vec);
+}
+
+void InferenceSession::inferRaw(const long long * ids, size_t n, real * vec, long long skip)
+{
+  long long dim = m_doc2vec.dim();
+  long long iter = m_max_passes > 0 ? m_max_passes : m_doc2vec.iter();
+  unsigned long long next_random = 1;
+  for (long long a = 0; a < dim; a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    vec[a] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / dim;
+  }
+  train(ids, n, skip, vec, 0, iter);
+}
+
+void InferenceSession::refine(const long long * ids, size_t n, const real * raw, real * vec, int passes, long long skip)
+{
+  long long iter = m_max_passes > 0 ? m_max_passes : m_doc2vec.iter();
+  if (passes > iter) passes = iter;
+  std::copy(raw, raw + m_doc2vec.dim(), vec);
+  train(ids, n, skip, vec, iter - passes, iter);
+  normalize(vec);
+}
+
+void InferenceSession::train(const long long * ids, size_t n, long long skip, real * vec,
+                             long long first_pass, long long iter)
+{
+  long long dim = m_doc2vec.dim();
+  real start_alpha = m_doc2vec.getStartAlpha();
+  // the lr and random state belong to this call, the model is only read
+  TrainModelThread & thread = *m_thread;
+  thread.m_next_random = 0;
+  thread.m_alpha = start_alpha * (1 - (double)first_pass / iter);
+  thread.m_doc_vector = vec;
+  thread.buildDocument(ids, n, skip);
+  for (m_passes = 0; first_pass + m_passes < iter;)
+  {
+    if (m_tolerance > 0) std::copy(vec, vec + dim, m_last.get());
+    thread.trainDocument();
+    m_passes++;
+    thread.m_alpha = start_alpha * (1 - (double)(first_pass + m_passes) / iter);
+    thread.m_alpha = MAX(thread.m_alpha, start_alpha * 0.0001);
+    if (m_tolerance > 0 && m_passes >= m_min_passes) {
+      real diff = 0, norm = 0;
+      for (long long a = 0; a < dim; a++) {
+        diff += (vec[a] - m_last[a]) * (vec[a] - m_last[a]);
+        norm += vec[a] * vec[a];
+      }
+      if (diff <= m_tolerance * m_tolerance * norm) break;
+    }
+  }
+}
+
+void InferenceSession::normalize(real * vec) const
+{
+  long long dim = m_doc2vec.dim();
+  real len = 0;
+  for(long long a = 0; a < dim; a++) len += vec[a] * vec[a];
+  len = sqrt(len);
+  for(long long a = 0; a < dim; a++) vec[a] /= len;
+}
+
+void InferenceSession::infer(const TaggedDocument & doc, real * vec, int skip)
+{
+  m_ids.clear();
+  m_doc2vec.wvocab().searchWords(doc.m_words, m_ids, skip);
+  infer(m_ids.data(), m_ids.size(), vec);
+}
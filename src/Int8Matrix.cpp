@@ -0,0 +1,164 @@
+#include <Int8Matrix.h>
+#include <KnnSearch.h>
+#include <DocFilter.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <cmath>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace doc2vec;
+
+static const size_t ROW_TILE = 256;
+static const size_t ALIGN = 32;
+
+Int8Matrix::Int8Matrix(size_t dim)
+  : m_dim(dim), m_stride((dim + ALIGN - 1) / ALIGN * ALIGN), m_scales(dim, 1)
+{
+}
+
+// integer dot product of two rows of stride bytes
+static inline int dotInt8(const signed char * a, const signed char * b, size_t stride)
+{
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (size_t d = 0; d < stride; d += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + d)), y = _mm256_loadu_si256((const __m256i *)(b + d));
+    // unsigned |x| times y with the sign of x, the codes stay within [-127, 127]
+    __m256i ux = _mm256_abs_epi8(x), sy = _mm256_sign_epi8(y, x);
+#if defined(__AVXVNNI__)
+    acc = _mm256_dpbusd_avx_epi32(acc, ux, sy);
+#elif defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    acc = _mm256_dpbusd_epi32(acc, ux, sy);
+#else
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(ux, sy), _mm256_set1_epi16(1)));
+#endif
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+  return _mm_cvtsi128_si32(s);
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (size_t d = 0; d < stride; d += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + d)), y = _mm_loadu_si128((const __m128i *)(b + d));
+    // sign extend to 16 bits
+    __m128i xl = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8), xh = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+    __m128i yl = _mm_srai_epi16(_mm_unpacklo_epi8(y, y), 8), yh = _mm_srai_epi16(_mm_unpackhi_epi8(y, y), 8);
+    acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(xl, yl), _mm_madd_epi16(xh, yh)));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+  return _mm_cvtsi128_si32(acc);
+#else
+  int f = 0;
+  for (size_t d = 0; d < stride; d++) f += a[d] * b[d];
+  return f;
+#endif
+}
+
+static inline signed char clip(real x)
+{
+  return (signed char)std::max(-127L, std::min(127L, lrintf(x)));
+}
+
+void Int8Matrix::quantize(const real * vectors, size_t rows, ThreadPool * pool)
+{
+  std::fill(m_scales.begin(), m_scales.end(), 0);
+  for (size_t a = 0; a < rows; a++) {
+    for (size_t d = 0; d < m_dim; d++) m_scales[d] = std::max(m_scales[d], (real)fabs(vectors[a * m_dim + d]));
+  }
+  for (auto & scale : m_scales) scale = scale > 0 ? scale / 127 : 1;
+  m_rows = 0;
+  if (!pool) {
+    update(vectors, 0, rows);
+    return;
+  }
+  m_codes.assign(rows * m_stride, 0);
+  m_rows = rows;
+  pool->parallel_for(rows, 1024, [&](size_t begin, size_t end, size_t) {
+    for (size_t a = begin; a < end; a++) {
+      for (size_t d = 0; d < m_dim; d++) m_codes[a * m_stride + d] = clip(vectors[a * m_dim + d] / m_scales[d]);
+    }
+  });
+}
+
+void Int8Matrix::update(const real * vectors, size_t begin, size_t rows)
+{
+  m_codes.resize(rows * m_stride, 0);
+  m_rows = rows;
+  for (size_t a = begin; a < rows; a++) {
+    for (size_t d = 0; d < m_dim; d++) m_codes[a * m_stride + d] = clip(vectors[a * m_dim + d] / m_scales[d]);
+  }
+}
+
+real Int8Matrix::quantizeQuery(const real * query, signed char * code) const
+{
+  real max = 0;
+  for (size_t d = 0; d < m_dim; d++) max = std::max(max, (real)fabs(query[d] * m_scales[d]));
+  real scale = max > 0 ? max / 127 : 1;
+  for (size_t d = 0; d < m_dim; d++) code[d] = clip(query[d] * m_scales[d] / scale);
+  std::fill(code + m_dim, code + m_stride, 0);
+  return scale;
+}
+
+void Int8Matrix::search(ThreadPool & pool, const real * queries, size_t q, size_t k,
+			knn_hit_t * hits, const long long * exclude, const DocFilter * filter) const
+{
+  if (q == 0 || k == 0) return;
+  std::vector<signed char> codes(q * m_stride);
+  std::vector<real> scales(q);
+  for (size_t i = 0; i < q; i++) scales[i] = quantizeQuery(queries + i * m_dim, &codes[i * m_stride]);
+  size_t workers = pool.size();
+  std::vector<knn_hit_t> heaps(workers * q * k);
+  std::vector<size_t> counts(workers * q, 0);
+  size_t tiles = (m_rows + ROW_TILE - 1) / ROW_TILE;
+  pool.parallel_for(tiles, 1, [&](size_t begin, size_t end, size_t worker) {
+    knn_hit_t * heap = &heaps[worker * q * k];
+    size_t * count = &counts[worker * q];
+    for (size_t t = begin; t < end; t++) {
+      size_t first = t * ROW_TILE, last = std::min(first + ROW_TILE, m_rows);
+      if (filter && !filter->any(first, last)) continue;
+      for (size_t i = 0; i < q; i++) {
+	const signed char * code = &codes[i * m_stride];
+	for (size_t r = first; r < last; r++) {
+	  if ((exclude && exclude[i] == (long long)r) || (filter && !filter->allowed(r))) continue;
+	  hit_push(heap + i * k, k, count[i], r, scales[i] * dotInt8(code, &m_codes[r * m_stride], m_stride));
+	}
+      }
+    }
+  });
+  for (size_t i = 0; i < q; i++) {
+    knn_hit_t * top = hits + i * k;
+    size_t n = 0;
+    for (size_t w = 0; w < workers; w++) {
+      const knn_hit_t * heap = &heaps[(w * q + i) * k];
+      for (size_t c = 0; c < counts[w * q + i]; c++) hit_push(top, k, n, heap[c].idx, heap[c].similarity);
+    }
+    hit_sort(top, n);
+    for (size_t c = n; c < k; c++) top[c] = knn_hit_t();
+  }
+}
+
+void Int8Matrix::save(FILE * fout) const
+{
+  long long dim = m_dim, rows = m_rows;
+  fwrite(&dim, sizeof(long long), 1, fout);
+  fwrite(&rows, sizeof(long long), 1, fout);
+  fwrite(m_scales.data(), sizeof(real), m_dim, fout);
+  for (size_t a = 0; a < m_rows; a++) fwrite(&m_codes[a * m_stride], 1, m_dim, fout);
+}
+
+void Int8Matrix::load(FILE * fin)
+{
+  long long dim, rows;
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&rows, sizeof(long long), 1, fin);
+  *this = Int8Matrix(dim);
+  fread(m_scales.data(), sizeof(real), m_dim, fin);
+  m_rows = rows;
+  m_codes.assign(m_rows * m_stride, 0);
+  for (size_t a = 0; a < m_rows; a++) fread(&m_codes[a * m_stride], 1, m_dim, fin);
+}
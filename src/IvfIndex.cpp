@@ -0,0 +1,141 @@
+#include <IvfIndex.h>
+#include <KnnSearch.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+using namespace doc2vec;
+
+// training rows per centroid
+static const size_t SAMPLE_PER_LIST = 64;
+
+size_t IvfIndex::nearest(const real * vec) const
+{
+  size_t best = 0;
+  real best_sim = -2;
+  for (size_t c = 0; c < m_lists.size(); c++) {
+    real sim = dot(vec, &m_centroids[c * m_dim], m_dim);
+    if (sim > best_sim) {
+      best_sim = sim;
+      best = c;
+    }
+  }
+  return best;
+}
+
+void IvfIndex::train(const real * vectors, size_t rows, size_t lists, int iterations, ThreadPool & pool)
+{
+  lists = std::max((size_t)1, std::min(lists, rows));
+  // sample rows, the first lists of them seed the centroids
+  std::vector<long long> sample(std::min(rows, lists * SAMPLE_PER_LIST));
+  unsigned long long next_random = 1;
+  for (size_t a = 0; a < sample.size(); a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    sample[a] = sample.size() == rows ? a : (next_random >> 16) % rows;
+  }
+  if (sample.size() == rows) {
+    for (size_t a = sample.size() - 1; a > 0; a--) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      std::swap(sample[a], sample[(next_random >> 16) % (a + 1)]);
+    }
+  }
+  m_lists.assign(lists, std::vector<long long>());
+  m_centroids.resize(lists * m_dim);
+  for (size_t c = 0; c < lists; c++) {
+    std::copy(vectors + sample[c] * m_dim, vectors + (sample[c] + 1) * m_dim, &m_centroids[c * m_dim]);
+  }
+  std::vector<size_t> assign(sample.size());
+  std::vector<size_t> counts(lists);
+  for (int it = 0; it < iterations; it++) {
+    pool.parallel_for(sample.size(), 64, [&](size_t begin, size_t end, size_t) {
+      for (size_t a = begin; a < end; a++) assign[a] = nearest(vectors + sample[a] * m_dim);
+    });
+    std::fill(m_centroids.begin(), m_centroids.end(), 0);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (size_t a = 0; a < sample.size(); a++) {
+      const real * vec = vectors + sample[a] * m_dim;
+      real * centroid = &m_centroids[assign[a] * m_dim];
+      for (size_t d = 0; d < m_dim; d++) centroid[d] += vec[d];
+      counts[assign[a]]++;
+    }
+    for (size_t c = 0; c < lists; c++) {
+      real * centroid = &m_centroids[c * m_dim];
+      if (counts[c] == 0) {
+	// empty list: restart from a random sample row
+	next_random = next_random * (unsigned long long)25214903917 + 11;
+	const real * vec = vectors + sample[(next_random >> 16) % sample.size()] * m_dim;
+	std::copy(vec, vec + m_dim, centroid);
+	continue;
+      }
+      real len = sqrt(dot(centroid, centroid, m_dim));
+      if (len > 0) for (size_t d = 0; d < m_dim; d++) centroid[d] /= len;
+    }
+  }
+  m_rows = 0;
+}
+
+void IvfIndex::add(const real * vectors, size_t rows, ThreadPool & pool)
+{
+  if (rows <= m_rows) return;
+  std::vector<size_t> assign(rows - m_rows);
+  pool.parallel_for(assign.size(), 64, [&](size_t begin, size_t end, size_t) {
+    for (size_t a = begin; a < end; a++) assign[a] = nearest(vectors + (m_rows + a) * m_dim);
+  });
+  for (size_t a = 0; a < assign.size(); a++) m_lists[assign[a]].push_back(m_rows + a);
+  m_rows = rows;
+}
+
+size_t IvfIndex::search(const real * vectors, const real * query, size_t k, size_t nprobe, knn_hit_t * hits) const
+{
+  nprobe = std::min(nprobe, m_lists.size());
+  if (k == 0 || nprobe == 0) return 0;
+  std::vector<std::pair<real, size_t>> probes(m_lists.size());
+  for (size_t c = 0; c < m_lists.size(); c++) probes[c] = std::make_pair(dot(query, &m_centroids[c * m_dim], m_dim), c);
+  std::partial_sort(probes.begin(), probes.begin() + nprobe, probes.end(), std::greater<std::pair<real, size_t>>());
+  std::vector<std::pair<real, long long>> found;
+  for (size_t p = 0; p < nprobe; p++) {
+    for (auto row : m_lists[probes[p].second]) found.push_back(std::make_pair(dot(query, vectors + row * m_dim, m_dim), row));
+  }
+  size_t n = std::min(k, found.size());
+  std::partial_sort(found.begin(), found.begin() + n, found.end(), std::greater<std::pair<real, long long>>());
+  for (size_t a = 0; a < n; a++) {
+    hits[a].idx = found[a].second;
+    hits[a].similarity = found[a].first;
+  }
+  return n;
+}
+
+void IvfIndex::save(FILE * fout) const
+{
+  long long dim = m_dim, rows = m_rows, lists = m_lists.size();
+  fwrite(&dim, sizeof(long long), 1, fout);
+  fwrite(&rows, sizeof(long long), 1, fout);
+  fwrite(&lists, sizeof(long long), 1, fout);
+  fwrite(m_centroids.data(), sizeof(real), m_centroids.size(), fout);
+  for (auto & list : m_lists) {
+    long long size = list.size();
+    fwrite(&size, sizeof(long long), 1, fout);
+    fwrite(list.data(), sizeof(long long), size, fout);
+  }
+}
+
+void IvfIndex::load(FILE * fin)
+{
+  long long dim, rows, lists;
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&rows, sizeof(long long), 1, fin);
+  fread(&lists, sizeof(long long), 1, fin);
+  m_dim = dim;
+  m_rows = rows;
+  m_centroids.resize(lists * dim);
+  fread(m_centroids.data(), sizeof(real), m_centroids.size(), fin);
+  m_lists.assign(lists, std::vector<long long>());
+  for (auto & list : m_lists) {
+    long long size;
+    fread(&size, sizeof(long long), 1, fin);
+    list.resize(size);
+    fread(list.data(), sizeof(long long), size, fin);
+  }
+}
@@ -0,0 +1,162 @@
+#include <KnnSearch.h>
+#include <DocFilter.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <vector>
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#define KNN_SIMD
+#endif
+
+using namespace doc2vec;
+
+// rows of a tile(kept in cache while every query block passes over it) and queries of a block
+static const size_t ROW_TILE = 256;
+static const size_t QUERY_BLOCK = 4;
+
+#if defined(__AVX__)
+typedef __m256 vec_t;
+static const size_t LANES = 8;
+static inline vec_t vzero() { return _mm256_setzero_ps(); }
+static inline vec_t vload(const real * p) { return _mm256_loadu_ps(p); }
+static inline vec_t vadd(vec_t a, vec_t b) { return _mm256_add_ps(a, b); }
+static inline vec_t vmul(vec_t a, vec_t b) { return _mm256_mul_ps(a, b); }
+static inline real vsum(vec_t v)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE__)
+typedef __m128 vec_t;
+static const size_t LANES = 4;
+static inline vec_t vzero() { return _mm_setzero_ps(); }
+static inline vec_t vload(const real * p) { return _mm_loadu_ps(p); }
+static inline vec_t vadd(vec_t a, vec_t b) { return _mm_add_ps(a, b); }
+static inline vec_t vmul(vec_t a, vec_t b) { return _mm_mul_ps(a, b); }
+static inline real vsum(vec_t s)
+{
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+#endif
+
+real doc2vec::dot(const real * a, const real * b, size_t dim)
+{
+  size_t d = 0;
+  real f = 0;
+#ifdef KNN_SIMD
+  vec_t s0 = vzero(), s1 = vzero();
+  for (; d + 2 * LANES <= dim; d += 2 * LANES) {
+    s0 = vadd(s0, vmul(vload(a + d), vload(b + d)));
+    s1 = vadd(s1, vmul(vload(a + d + LANES), vload(b + d + LANES)));
+  }
+  for (; d + LANES <= dim; d += LANES) s0 = vadd(s0, vmul(vload(a + d), vload(b + d)));
+  f = vsum(vadd(s0, s1));
+#endif
+  for (; d < dim; d++) f += a[d] * b[d];
+  return f;
+}
+
+// similarities of QUERY_BLOCK consecutive queries to row, every row load is shared by the block
+static inline void dotBlock(const real * queries, const real * row, size_t dim, real * sims)
+{
+  const real * q0 = queries, * q1 = q0 + dim, * q2 = q1 + dim, * q3 = q2 + dim;
+  size_t d = 0;
+  real f0 = 0, f1 = 0, f2 = 0, f3 = 0;
+#ifdef KNN_SIMD
+  vec_t s0 = vzero(), s1 = vzero(), s2 = vzero(), s3 = vzero();
+  for (; d + LANES <= dim; d += LANES) {
+    vec_t r = vload(row + d);
+    s0 = vadd(s0, vmul(vload(q0 + d), r));
+    s1 = vadd(s1, vmul(vload(q1 + d), r));
+    s2 = vadd(s2, vmul(vload(q2 + d), r));
+    s3 = vadd(s3, vmul(vload(q3 + d), r));
+  }
+  f0 = vsum(s0);
+  f1 = vsum(s1);
+  f2 = vsum(s2);
+  f3 = vsum(s3);
+#endif
+  for (; d < dim; d++) {
+    f0 += q0[d] * row[d];
+    f1 += q1[d] * row[d];
+    f2 += q2[d] * row[d];
+    f3 += q3[d] * row[d];
+  }
+  sims[0] = f0;
+  sims[1] = f1;
+  sims[2] = f2;
+  sims[3] = f3;
+}
+
+// min heap on similarity, the worst of the best k on top
+static inline bool hitCompare(const knn_hit_t & a, const knn_hit_t & b)
+{
+  return a.similarity > b.similarity;
+}
+
+void doc2vec::hit_push(knn_hit_t * heap, size_t k, size_t & n, long long idx, real similarity)
+{
+  if (n == k) {
+    if (similarity <= heap[0].similarity) return;
+    std::pop_heap(heap, heap + n, hitCompare);
+    n--;
+  }
+  heap[n].idx = idx;
+  heap[n].similarity = similarity;
+  std::push_heap(heap, heap + ++n, hitCompare);
+}
+
+void doc2vec::hit_sort(knn_hit_t * heap, size_t n)
+{
+  std::sort_heap(heap, heap + n, hitCompare);
+}
+
+void KnnSearch::search(ThreadPool & pool, const real * queries, size_t q, size_t k,
+		       knn_hit_t * hits, const long long * exclude, const DocFilter * filter) const
+{
+  if (q == 0 || k == 0) return;
+  size_t workers = pool.size();
+  std::vector<knn_hit_t> heaps(workers * q * k);
+  std::vector<size_t> counts(workers * q, 0);
+  size_t tiles = (m_rows + ROW_TILE - 1) / ROW_TILE;
+  pool.parallel_for(tiles, 1, [&](size_t begin, size_t end, size_t worker) {
+    knn_hit_t * heap = &heaps[worker * q * k];
+    size_t * count = &counts[worker * q];
+    real sims[QUERY_BLOCK];
+    for (size_t t = begin; t < end; t++) {
+      size_t first = t * ROW_TILE, last = std::min(first + ROW_TILE, m_rows);
+      if (filter && !m_ids && !filter->any(first, last)) continue;
+      for (size_t b = 0; b < q; b += QUERY_BLOCK) {
+	size_t block = std::min(QUERY_BLOCK, q - b);
+	const real * block_queries = queries + b * m_dim;
+	for (size_t r = first; r < last; r++) {
+	  long long idx = m_ids ? m_ids[r] : r;
+	  if (filter && !filter->allowed(idx)) continue;
+	  const real * row = m_targets + idx * m_dim;
+	  if (block == QUERY_BLOCK) dotBlock(block_queries, row, m_dim, sims);
+	  else for (size_t i = 0; i < block; i++) sims[i] = dot(block_queries + i * m_dim, row, m_dim);
+	  for (size_t i = 0; i < block; i++) {
+	    if (exclude && exclude[b + i] == idx) continue;
+	    hit_push(heap + (b + i) * k, k, count[b + i], idx, sims[i]);
+	  }
+	}
+      }
+    }
+  });
+  // merge the workers' heaps of every query
+  for (size_t i = 0; i < q; i++) {
+    knn_hit_t * top = hits + i * k;
+    size_t n = 0;
+    for (size_t w = 0; w < workers; w++) {
+      const knn_hit_t * heap = &heaps[(w * q + i) * k];
+      for (size_t c = 0; c < counts[w * q + i]; c++) hit_push(top, k, n, heap[c].idx, heap[c].similarity);
+    }
+    hit_sort(top, n);
+    for (size_t c = n; c < k; c++) top[c] = knn_hit_t();
+  }
+}
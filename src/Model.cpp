@@ -1,8 +1,17 @@
 #include <Model.h>
 #include <TrainModelThread.h>
+#include <InferenceSession.h>
 #include <Input.h>
+#include <WMD.h>
 
 #include <cmath>
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
 
 namespace doc2vec {
   static void heap_adjust(knn_item_t * knns, int s, int m) {
@@ -25,6 +34,15 @@ namespace doc2vec {
     }
   }
 
+  void top_add(knn_item_t * knns, size_t k, size_t & n, long long idx, real similarity) {
+    if (n < k) {
+      knns[n].similarity = similarity;
+      knns[n].idx = idx;
+      if (++n == k) top_init(knns, k);
+    }
+    else top_collect(knns, k, idx, similarity);
+  }
+
   void top_collect(knn_item_t * knns, size_t k, long long idx, real similarity) {
     if (similarity <= knns[0].similarity) return;
     knns[0].similarity = similarity;
@@ -49,18 +67,22 @@ namespace doc2vec {
 
 using namespace doc2vec;
 
-static void * trainModelThread(void * params);
+// training state of a thread at an epoch boundary
+struct doc2vec::checkpoint_thread_t {
+  long long seek;
+  long long limit_doc;
+  unsigned long long next_random;
+};
 
-void * trainModelThread(void * params)
+Model::Model() : m_sif_once(std::make_unique<std::once_flag>())
 {
-  TrainModelThread * tparams = (TrainModelThread *)params;
-  tparams->train();
-  return NULL;
+  initExpTable();
+  initLogSigmoidTable();
 }
 
-Model::Model()
+Model::~Model()
 {
-  initExpTable();
+  if (m_doc_fd >= 0) close(m_doc_fd);
 }
 
 void Model::initExpTable()
@@ -74,6 +96,17 @@ void Model::initExpTable()
   }
 }
 
+void Model::initLogSigmoidTable()
+{
+  // log(sigmoid(x)) on [-MAX_EXP, MAX_EXP], interpolated between neighbours
+  m_logSigmoidTable = std::unique_ptr<real[]>(new real[EXP_TABLE_SIZE + 1]);
+  for (int i = 0; i <= EXP_TABLE_SIZE; i++)
+  {
+    double x = (i / (double)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP;
+    m_logSigmoidTable[i] = -(std::max(-x, 0.0) + log1p(exp(-fabs(x))));
+  }
+}
+
 void Model::initNegTable()
 {
   m_negative_sample_table = std::unique_ptr<int[]>(new int[negative_sample_table_size]);
@@ -92,16 +125,38 @@ void Model::initNegTable()
     }
     if (i >= words.size()) i = words.size() - 1;
   }
+  m_neg_table_pow = train_words_pow;
+}
+
+void Model::addNegTableWords(long long first_word)
+{
+  // new words take over random slots in proportion to their share, which shrinks every
+  // older word by the same factor without rebuilding the table
+  auto & words = m_word_vocab->getWords();
+  real power = 0.75;
+  double added_pow = 0;
+  for (size_t a = first_word; a < words.size(); a++) added_pow += pow(words[a].cn, power);
+  m_neg_table_pow += added_pow;
+  unsigned long long next_random = first_word;
+  for (size_t a = first_word; a < words.size(); a++) {
+    long long slots = llround(pow(words[a].cn, power) / m_neg_table_pow * negative_sample_table_size);
+    for (long long b = 0; b < MAX(slots, 1LL); b++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      m_negative_sample_table[(next_random >> 16) % negative_sample_table_size] = a;
+    }
+  }
 }
 
 void Model::train(Input & train_file,
   size_t dim, bool cbow, bool hs, int negative,
   int iter, int window,
   real alpha, real sample,
-  int min_count, int threads)
+  int min_count, int threads, bool dbow_words)
 {
   fprintf(stderr, "Starting training\n");
   m_cbow = cbow;
+  m_dbow_words = dbow_words;
+  m_freeze_words = false;
   m_hs = hs;
   m_negative = negative;
   m_window = window;
@@ -116,37 +171,499 @@ void Model::train(Input & train_file,
 
   fprintf(stderr, "word vocab: %d, doc vocab: %d\n", int(m_word_vocab->size()), int(m_doc_vocab->size()));
   
+  m_train_words = m_word_vocab->getTrainWords();
+  trainModelThreads(train_file, threads);
+}
+
+void Model::train(Input & train_file, const Model & base, bool freeze_words,
+  int iter, real alpha, int threads)
+{
+  fprintf(stderr, "Starting training from a trained model\n");
+  m_cbow = base.m_cbow;
+  m_hs = base.m_hs;
+  m_negative = base.m_negative;
+  m_window = base.m_window;
+  m_start_alpha = alpha;
+  m_sample = base.m_sample;
+  m_iter = iter;
+  m_dbow_words = base.m_dbow_words;
+  m_freeze_words = freeze_words;
+  // the documents only need the output layer, the word vectors stay untrained
+  if (!m_cbow && !m_dbow_words) fprintf(stderr, "The base model is pure PV-DBOW, word queries stay unavailable\n");
+
+  m_word_vocab = std::make_unique<Vocabulary>(*base.m_word_vocab);
+  m_doc_vocab = std::make_unique<Vocabulary>(train_file, 1, true);
+  m_nn = std::make_unique<NN>(*base.m_nn, m_doc_vocab->size());
+  if (m_negative > 0) initNegTable();
+
+  fprintf(stderr, "word vocab: %d, doc vocab: %d\n", int(m_word_vocab->size()), int(m_doc_vocab->size()));
+
+  // the base vocabulary counts the base corpus, the lr schedule needs the new one
+  countTrainWords(train_file);
+  trainModelThreads(train_file, threads);
+}
+
+void Model::trainModelThreads(Input & train_file, int threads)
+{
   m_brown_corpus = std::make_unique<TaggedBrownCorpus>(train_file);
-  m_alpha = alpha;
+  initSchedule();
+
+  if (m_processes > 1) {
+    trainProcesses(train_file, threads);
+  } else {
+    std::vector<TrainModelThread *> trainModelThreads;
+    initTrainModelThreads(train_file, 0, -1, threads, trainModelThreads);
+    runTrainModelThreads(trainModelThreads);
+  }
+
+  // for(size_t i =  0; i < m_trainModelThreads.size(); i++) m_trainModelThreads[i]->m_corpus->close();
+  // m_brown_corpus->close();
+  
+  m_nn->norm(&threadPool());
+  m_wmd = std::make_unique<WMD>(this);
+  resetQueryState();
+  m_wmd->train();
+}
+
+void Model::initSchedule()
+{
+  m_alpha = m_start_alpha;
   m_word_count_actual = 0;
+  m_epochs_done = 0;
+  m_train_iter = m_iter;
+  m_lr_alpha = m_start_alpha;
+  m_lr_start_words = 0;
+  m_lr_end_words = m_iter * m_train_words;
+  m_holdout_best = -std::numeric_limits<real>::max();
+  m_holdout_bad_epochs = 0;
+  m_epoch_log.clear();
+}
+
+long long Model::countTrainWords(Input & input)
+{
+  long long docs = 0;
+  m_train_words = 0;
+  TaggedBrownCorpus brown_corpus(input);
+  TaggedDocument * doc = NULL;
+  while((doc = brown_corpus.next()) != NULL)
+  {
+    docs++;
+    for (auto & word : doc->m_words) {
+      long long word_idx = m_word_vocab->searchVocab(word);
+      if (word_idx == 0) break;
+      if (word_idx > 0) m_train_words++;
+    }
+  }
+  return docs;
+}
 
+void Model::trainIncrement(Input & input, int threads, bool freeze_words)
+{
+  // increments train without checkpoints or early stopping
+  long long docs = countTrainWords(input);
+  bool model_freeze_words = m_freeze_words;
+  int checkpoint_epochs = m_checkpoint_epochs, holdout_every = m_holdout_every;
+  m_freeze_words = freeze_words;
+  m_checkpoint_epochs = m_holdout_every = 0;
+  initSchedule();
   std::vector<TrainModelThread *> trainModelThreads;
-  initTrainModelThreads(train_file, threads, iter, trainModelThreads);
+  initTrainModelThreads(input, 0, docs, threads, trainModelThreads);
+  runTrainModelThreads(trainModelThreads);
+  m_freeze_words = model_freeze_words;
+  m_checkpoint_epochs = checkpoint_epochs;
+  m_holdout_every = holdout_every;
+}
+
+bool Model::add_documents(Input & input, int threads)
+{
+  if (!checkDocVectors("add_documents")) return false;
+  long long first_doc = m_doc_vocab->size();
+  m_word_vocab->countDocuments(input, *m_doc_vocab, m_word_vocab->size());
+  size_t added = m_doc_vocab->addDocTags(input);
+  fprintf(stderr, "Adding %zu documents\n", added);
+  if (added == 0) return true;
+  m_nn->addDocuments(added);
+
+  // only the new document vectors learn, the word parameters and older documents stay fixed
+  m_first_train_doc = first_doc;
+  trainIncrement(input, threads, true);
+  m_first_train_doc = 0;
+
+  m_nn->normDocuments(first_doc);
+  m_wmd->add(input, first_doc);
+  // older vectors are unchanged: the indexes are kept and the new documents appended
+  std::unique_ptr<HnswIndex> word_hnsw = std::move(m_word_hnsw), doc_hnsw = std::move(m_doc_hnsw);
+  std::unique_ptr<IvfIndex> doc_ivf = std::move(m_doc_ivf);
+  std::unique_ptr<PqIndex> doc_pq = std::move(m_doc_pq);
+  std::unique_ptr<BinaryIndex> word_bits = std::move(m_word_bits), doc_bits = std::move(m_doc_bits);
+  std::unique_ptr<PcaIndex> word_pca = std::move(m_word_pca), doc_pca = std::move(m_doc_pca);
+  resetQueryState();
+  m_word_hnsw = std::move(word_hnsw);
+  m_doc_hnsw = std::move(doc_hnsw);
+  m_doc_ivf = std::move(doc_ivf);
+  m_doc_pq = std::move(doc_pq);
+  m_word_bits = std::move(word_bits);
+  m_doc_bits = std::move(doc_bits);
+  m_word_pca = std::move(word_pca);
+  m_doc_pca = std::move(doc_pca);
+  if (m_doc_hnsw) m_doc_hnsw->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  if (m_doc_ivf) m_doc_ivf->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  if (m_doc_pq) m_doc_pq->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  if (m_doc_bits) m_doc_bits->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  if (m_doc_pca) m_doc_pca->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  return true;
+}
+
+bool Model::continue_train(Input & train_file, int min_count, int threads)
+{
+  if (!checkDocVectors("continue_train")) return false;
+  fprintf(stderr, "Continuing training\n");
+  long long first_word = m_word_vocab->size();
+  if (m_hs) {
+    fprintf(stderr, "New words need a negative sampling only model, vocabulary kept\n");
+  } else {
+    // out of vocabulary words, most frequent first
+    std::unordered_map<std::string, size_t> counts;
+    TaggedBrownCorpus brown_corpus(train_file);
+    TaggedDocument * doc = NULL;
+    while((doc = brown_corpus.next()) != NULL)
+    {
+      for (auto & word : doc->m_words) {
+	long long word_idx = m_word_vocab->searchVocab(word);
+	if (word_idx == 0) break;
+	if (word_idx < 0) counts[word]++;
+      }
+    }
+    std::vector<std::pair<std::string, size_t>> new_words;
+    for (auto & count : counts) if (count.second >= (size_t)min_count) new_words.push_back(count);
+    std::sort(new_words.begin(), new_words.end(), [](const std::pair<std::string, size_t> & a,
+						     const std::pair<std::string, size_t> & b) {
+      return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    for (auto & word : new_words) m_word_vocab->addWord(word.first, word.second);
+    fprintf(stderr, "Adding %zu words\n", new_words.size());
+    if (!new_words.empty()) {
+      m_nn->addWords(new_words.size());
+      addNegTableWords(first_word);
+    }
+  }
+  long long first_doc = m_doc_vocab->size();
+  // new words are counted in every document, the known ones in the new documents only
+  m_word_vocab->countDocuments(train_file, *m_doc_vocab, first_word);
+  size_t added = m_doc_vocab->addDocTags(train_file);
+  fprintf(stderr, "Adding %zu documents\n", added);
+  if (added > 0) m_nn->addDocuments(added);
+
+  trainIncrement(train_file, threads, false);
+
+  m_nn->norm(&threadPool());
+  m_wmd->add(train_file, first_doc);
+  resetQueryState();
+  return true;
+}
+
+void Model::trainProcesses(Input & train_file, int threads)
+{
+  // split the corpus into contiguous partitions, one per process
+  std::vector<long long> seeks, doc_nums, train_words;
+  long long limit = m_doc_vocab->size() / m_processes;
+  long long sub_size = 0, words = 0;
+  long long tell = 0;
+  TaggedBrownCorpus brown_corpus(train_file);
+  TaggedDocument * doc = NULL;
+  while((doc = brown_corpus.next()) != NULL)
+  {
+    for (auto & word : doc->m_words) {
+      long long word_idx = m_word_vocab->searchVocab(word);
+      if (word_idx == 0) break;
+      if (word_idx > 0) words++;
+    }
+    sub_size++;
+    if(sub_size >= limit && seeks.size() + 1 < size_t(m_processes))
+    {
+      seeks.push_back(tell);
+      doc_nums.push_back(sub_size);
+      train_words.push_back(words);
+      tell = brown_corpus.tell();
+      sub_size = words = 0;
+    }
+  }
+  seeks.push_back(tell);
+  doc_nums.push_back(sub_size);
+  train_words.push_back(words);
+
+  fprintf(stderr, "Train with %d processes\n", (int)seeks.size());
+  if (m_holdout_every > 0) {
+    fprintf(stderr, "Early stopping is not supported with processes, disabled\n");
+    m_holdout_every = 0;
+  }
+  // the word parameters are averaged at epoch boundaries only(ModelAverager::epochDone), not within an epoch
+  m_averager = std::make_unique<ModelAverager>(*m_nn, seeks.size());
+  std::vector<pid_t> pids;
+  for (size_t p = 0; p < seeks.size(); p++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "ERROR: unable to fork training process\n");
+      exit(1);
+    }
+    if (pid == 0) {
+      resetAfterFork(threads);
+      m_train_words = train_words[p];
+      m_lr_end_words = m_iter * m_train_words;
+      std::vector<TrainModelThread *> trainModelThreads;
+      initTrainModelThreads(train_file, seeks[p], doc_nums[p], threads, trainModelThreads);
+      m_averager->attach(p, trainModelThreads.size());
+      runTrainModelThreads(trainModelThreads);
+      // document vectors are partition local
+      TaggedBrownCorpus partition(train_file, seeks[p], doc_nums[p]);
+      while((doc = partition.next()) != NULL)
+      {
+	long long doc_idx = m_doc_vocab->searchVocab(doc->m_tag);
+	if (doc_idx < 0) continue;
+	real * src = &(m_nn->get_dsyn0()[doc_idx * m_nn->dim()]);
+	std::copy(src, src + m_nn->dim(), m_averager->docVector(doc_idx));
+      }
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+  bool failed = false;
+  for (size_t p = 0; p < pids.size(); p++) {
+    int status;
+    wait(&status);
+    if (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+      // the others would block forever on the epoch barrier
+      for (auto pid : pids) kill(pid, SIGKILL);
+      failed = true;
+    }
+  }
+  if (failed) {
+    fprintf(stderr, "ERROR: training process failed\n");
+    exit(1);
+  }
+  m_averager->pull();
+  std::copy(m_averager->docVector(0), m_averager->docVector(m_nn->m_corpus_size), m_nn->get_dsyn0());
+  m_averager.reset();
+}
+
+void Model::resetAfterFork(int threads)
+{
+  // fork() copies the pool but none of the parent's threads: destroying the copy would join workers
+  // that don't exist here, and its lock may have been held by another parent thread. The child ends
+  // with _exit, so both are released unowned rather than destroyed
+  m_pool_mutex.release();
+  m_pool_mutex = std::make_unique<std::mutex>();
+  std::make_unique<std::shared_ptr<ThreadPool>>(std::move(m_pool)).release();
+  m_pool = std::make_shared<ThreadPool>(threads);
+}
 
+void Model::runTrainModelThreads(std::vector<TrainModelThread *> & trainModelThreads)
+{
   fprintf(stderr, "Train with %d threads\n", (int)trainModelThreads.size());
-  auto pt = std::make_unique<pthread_t[]>(trainModelThreads.size());
-  for (size_t a = 0; a < trainModelThreads.size(); a++) {
-    pthread_create(&pt[a], NULL, trainModelThread, (void *)trainModelThreads[a]);
+  if (m_holdout_every > 0 && !m_hs) {
+    fprintf(stderr, "Early stopping needs hierarchical softmax, disabled\n");
+    m_holdout_every = 0;
   }
-  for (size_t a = 0; a < trainModelThreads.size(); a++) {
-    pthread_join(pt[a], NULL);
-    delete trainModelThreads[a];
+  // the held-out score is a word likelihood, it can't change while the word parameters don't learn
+  if (m_holdout_every > 0 && (m_freeze_words || (!m_cbow && !m_dbow_words))) {
+    fprintf(stderr, "Early stopping needs word vectors that train(not frozen or pure PV-DBOW), disabled\n");
+    m_holdout_every = 0;
   }
+  m_epoch_sync = (m_checkpoint_epochs > 0 || m_holdout_every > 0) && !m_averager;
+  if (m_epoch_sync) {
+    pthread_barrier_init(&m_epoch_barrier, NULL, trainModelThreads.size());
+    m_train_threads = &trainModelThreads;
+  }
+  // training threads may wait for each other, each of them needs its own thread
+  auto & pool = threadPool();
+  pool.gang(trainModelThreads.size(), [&](size_t a) {
+    trainModelThreads[a]->useScratch(pool.scratch(m_nn->dim() * 2));
+    trainModelThreads[a]->train();
+  });
+  for (auto model_thread : trainModelThreads) delete model_thread;
+  if (m_epoch_sync) {
+    pthread_barrier_destroy(&m_epoch_barrier);
+    m_train_threads = nullptr;
+    m_epoch_sync = false;
+    if (m_checkpoint_writer.joinable()) m_checkpoint_writer.join();
+  }
+}
 
-  // for(size_t i =  0; i < m_trainModelThreads.size(); i++) m_trainModelThreads[i]->m_corpus->close();
-  // m_brown_corpus->close();
-  
-  m_nn->norm();
+void Model::epochDone(TrainModelThread * thread)
+{
+  // every thread scores its own held-out documents
+  if (m_holdout_every > 0) thread->holdoutLikelihood();
+  if (pthread_barrier_wait(&m_epoch_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+    m_epochs_done++;
+    m_epoch_log.push_back({m_epochs_done, m_lr_alpha * (1 - (m_word_count_actual - m_lr_start_words) /
+							  (real)(m_lr_end_words - m_lr_start_words + 1)), 0});
+    if (m_holdout_every > 0) evaluateHoldout();
+    if (m_checkpoint_epochs > 0 && m_epochs_done % m_checkpoint_epochs == 0 && m_epochs_done < m_train_iter) writeCheckpoint();
+  }
+  pthread_barrier_wait(&m_epoch_barrier);
+}
+
+void Model::evaluateHoldout()
+{
+  real likelihood = 0;
+  long long words = 0;
+  for (auto t : *m_train_threads) {
+    likelihood += t->m_holdout_likelihood;
+    words += t->m_holdout_words;
+  }
+  likelihood /= MAX(words, 1LL);
+  fprintf(stderr, "\nEpoch %d held-out likelihood per word: %f\n", m_epochs_done, likelihood);
+  m_epoch_log.back().holdout_likelihood = likelihood;
+  if (likelihood > m_holdout_best + fabs(m_holdout_best) * 1e-3) {
+    m_holdout_best = likelihood;
+    m_holdout_bad_epochs = 0;
+  } else if (++m_holdout_bad_epochs >= m_patience && m_epochs_done + 1 < m_train_iter) {
+    // anneal the lr to zero over one last epoch instead of the remaining ones
+    fprintf(stderr, "Held-out likelihood stopped improving, last epoch: %d\n", m_epochs_done + 1);
+    m_train_iter = m_epochs_done + 1;
+    m_lr_alpha = m_alpha;
+    m_lr_start_words = m_word_count_actual;
+    m_lr_end_words = m_word_count_actual + m_train_words;
+  }
+}
+
+void Model::setEarlyStopping(real holdout, int patience)
+{
+  m_holdout_every = holdout > 0 ? MAX(1, int(1 / holdout + 0.5)) : 0;
+  m_patience = MAX(1, patience);
+}
+
+// what write puts into a file, kept in memory
+static std::string memoryFile(const std::function<void(FILE *)> & write)
+{
+  char * buf = NULL;
+  size_t size = 0;
+  FILE * fout = open_memstream(&buf, &size);
+  write(fout);
+  fclose(fout);
+  std::string data(buf, size);
+  free(buf);
+  return data;
+}
+
+void Model::writeCheckpoint()
+{
+  // snapshot while all training threads wait on the epoch barrier, write it in the background:
+  // the writer only sees the copies made here
+  auto nn = std::make_shared<NN>(*m_nn);
+  std::vector<checkpoint_thread_t> threads;
+  for (auto t : *m_train_threads) {
+    threads.push_back({ t->m_corpus->getSeek(), t->m_corpus->getLimitDoc(), t->m_next_random });
+  }
+  std::string head = memoryFile([this](FILE * fout) {
+    m_word_vocab->save(fout);
+    m_doc_vocab->save(fout);
+  });
+  std::string tail = memoryFile([this, &threads](FILE * fout) {
+    saveParams(fout);
+    int dbow_words = m_dbow_words, freeze_words = m_freeze_words, thread_num = threads.size();
+    fwrite(&dbow_words, sizeof(int), 1, fout);
+    fwrite(&freeze_words, sizeof(int), 1, fout);
+    fwrite(&m_alpha, sizeof(real), 1, fout);
+    fwrite(&m_word_count_actual, sizeof(long long), 1, fout);
+    fwrite(&m_train_words, sizeof(long long), 1, fout);
+    fwrite(&m_epochs_done, sizeof(int), 1, fout);
+    fwrite(&m_train_iter, sizeof(int), 1, fout);
+    fwrite(&m_lr_alpha, sizeof(real), 1, fout);
+    fwrite(&m_lr_start_words, sizeof(long long), 1, fout);
+    fwrite(&m_lr_end_words, sizeof(long long), 1, fout);
+    fwrite(&m_holdout_best, sizeof(real), 1, fout);
+    fwrite(&m_holdout_bad_epochs, sizeof(int), 1, fout);
+    fwrite(&thread_num, sizeof(int), 1, fout);
+    fwrite(threads.data(), sizeof(checkpoint_thread_t), threads.size(), fout);
+    // the held-out documents and the patience the best score and bad epochs above belong to
+    fwrite(&m_holdout_every, sizeof(int), 1, fout);
+    fwrite(&m_patience, sizeof(int), 1, fout);
+  });
+  std::string path = m_checkpoint_path;
+
+  if (m_checkpoint_writer.joinable()) m_checkpoint_writer.join();
+  m_checkpoint_writer = std::thread([path, nn, head, tail]() {
+    std::string tmp = path + ".tmp";
+    FILE * fout = fopen(tmp.c_str(), "wb");
+    if (!fout) {
+      fprintf(stderr, "Unable to open file %s\n", tmp.c_str());
+      return;
+    }
+    fwrite(head.data(), 1, head.size(), fout);
+    nn->save(fout);
+    fwrite(tail.data(), 1, tail.size(), fout);
+    fclose(fout);
+    rename(tmp.c_str(), path.c_str());
+  });
+}
+
+void Model::resume(Input & train_file, FILE * fin)
+{
+  fprintf(stderr, "Resuming training\n");
+  m_word_vocab = std::make_unique<Vocabulary>();
+  m_word_vocab->load(fin);
+  m_doc_vocab = std::make_unique<Vocabulary>();
+  m_doc_vocab->load(fin);
+  m_nn = std::make_unique<NN>();
+  m_nn->load(fin);
+  loadParams(fin);
+
+  int dbow_words, freeze_words, thread_num;
+  fread(&dbow_words, sizeof(int), 1, fin);
+  fread(&freeze_words, sizeof(int), 1, fin);
+  fread(&m_alpha, sizeof(real), 1, fin);
+  fread(&m_word_count_actual, sizeof(long long), 1, fin);
+  fread(&m_train_words, sizeof(long long), 1, fin);
+  fread(&m_epochs_done, sizeof(int), 1, fin);
+  fread(&m_train_iter, sizeof(int), 1, fin);
+  fread(&m_lr_alpha, sizeof(real), 1, fin);
+  fread(&m_lr_start_words, sizeof(long long), 1, fin);
+  fread(&m_lr_end_words, sizeof(long long), 1, fin);
+  fread(&m_holdout_best, sizeof(real), 1, fin);
+  fread(&m_holdout_bad_epochs, sizeof(int), 1, fin);
+  m_epoch_log.clear();
+  fread(&thread_num, sizeof(int), 1, fin);
+  std::vector<checkpoint_thread_t> threads(thread_num);
+  fread(threads.data(), sizeof(checkpoint_thread_t), thread_num, fin);
+  // early stopping continues as checkpointed(the same held-out documents), older checkpoints end
+  // before it and keep setEarlyStopping
+  int holdout_every, patience;
+  if (fread(&holdout_every, sizeof(int), 1, fin) == 1 && fread(&patience, sizeof(int), 1, fin) == 1) {
+    m_holdout_every = holdout_every;
+    m_patience = patience;
+  }
+  m_dbow_words = dbow_words;
+  m_freeze_words = freeze_words;
+  if (m_negative > 0) initNegTable();
+
+  fprintf(stderr, "word vocab: %d, doc vocab: %d, epochs done: %d\n",
+	  int(m_word_vocab->size()), int(m_doc_vocab->size()), m_epochs_done);
+
+  m_brown_corpus = std::make_unique<TaggedBrownCorpus>(train_file);
+  std::vector<TrainModelThread *> trainModelThreads;
+  for (auto & state : threads) {
+    auto sub_c = std::make_unique<TaggedBrownCorpus>(train_file, state.seek, state.limit_doc);
+    auto model_thread = new TrainModelThread(trainModelThreads.size(), this, std::move(sub_c), false);
+    model_thread->m_next_random = state.next_random;
+    model_thread->m_local_iter = m_epochs_done;
+    trainModelThreads.push_back(model_thread);
+  }
+  runTrainModelThreads(trainModelThreads);
+
+  m_nn->norm(&threadPool());
   m_wmd = std::make_unique<WMD>(this);
+  resetQueryState();
   m_wmd->train();
 }
 
-void Model::initTrainModelThreads(Input & train_file, int threads, int iter, std::vector<TrainModelThread *> & trainModelThreads)
+void Model::initTrainModelThreads(Input & train_file, long long seek, long long limit_doc, int threads,
+  std::vector<TrainModelThread *> & trainModelThreads)
 {
-  long long limit = m_doc_vocab->size() / threads;
+  long long limit = (limit_doc >= 0 ? limit_doc : m_doc_vocab->size()) / threads;
   long long sub_size = 0;
-  long long tell = 0;
-  TaggedBrownCorpus brown_corpus(train_file);
+  long long tell = seek;
+  TaggedBrownCorpus brown_corpus(train_file, seek, limit_doc);
   TaggedDocument * doc = NULL;
   while((doc = brown_corpus.next()) != NULL)
   {
@@ -161,7 +678,7 @@ void Model::initTrainModelThreads(Input & train_file, int threads, int iter, std
     }
   }
   if (trainModelThreads.size() < size_t(threads)) {
-    auto sub_c = std::make_unique<TaggedBrownCorpus>(train_file, tell, -1);
+    auto sub_c = std::make_unique<TaggedBrownCorpus>(train_file, tell, limit_doc >= 0 ? sub_size : -1);
     auto model_thread = new TrainModelThread(trainModelThreads.size(), this, std::move(sub_c), false);
     trainModelThreads.push_back(model_thread);
   }
@@ -170,83 +687,479 @@ void Model::initTrainModelThreads(Input & train_file, int threads, int iter, std
 
 bool Model::obj_knn_objs(const std::string & search, const real * src,
   bool search_is_word, bool target_is_word,
-  knn_item_t * knns, size_t k)
+  knn_item_t * knns, size_t k, const search_params_t & params, const DocFilter * filter)
 {
+  if ((search_is_word || target_is_word) && !checkWordVectors("word query")) return false;
   const Vocabulary * search_vocab = search_is_word ? m_word_vocab.get() : m_doc_vocab.get();
-  const real * search_vectors = search_is_word ? m_nn->get_syn0norm() : m_nn->get_dsyn0norm();
-  const real * target_vectors = target_is_word ? m_nn->get_syn0norm() : m_nn->get_dsyn0norm();
-  size_t target_size = target_is_word ? m_nn->m_vocab_size : m_nn->m_corpus_size;
-  const Vocabulary * target_vocab = target_is_word ? m_word_vocab.get() : m_doc_vocab.get();
-  long long a;
+  long long a = -1;
+  std::vector<real> search_vector;
   if (!src) {
     a = search_vocab->searchVocab(search);
     if (a < 0) {
       return false;
     }
-    src = &(search_vectors[a * m_nn->dim()]);
-  }
-  for (size_t b = 0, c = 0; b < target_size; b++)
-  {
-    if (search_is_word == target_is_word && a == b) continue;
-    auto target = &(target_vectors[b * m_nn->dim()]);
-    if (c < k) {
-      knns[c].similarity = similarity(src, target);
-      knns[c].idx = b;
-      c++;
-      if (c == k) top_init(knns, k);
+    if (search_is_word) src = &(m_nn->get_syn0norm()[a * m_nn->dim()]);
+    else {
+      search_vector.resize(m_nn->dim());
+      doc_vector(a, search_vector.data());
+      src = search_vector.data();
     }
-    else top_collect(knns, k, b, similarity(src, target));
   }
-  top_sort(knns, k);
-  auto & target_words = target_vocab->getWords();
-  for (size_t b = 0; b < k; b++) knns[b].word = target_words[knns[b].idx].word;
+  long long exclude = search_is_word == target_is_word ? a : -1;
+  std::vector<knn_hit_t> hits(k + 1);
+  const HnswIndex * hnsw = target_is_word ? m_word_hnsw.get() : m_doc_hnsw.get();
+  const IvfIndex * ivf = target_is_word ? nullptr : m_doc_ivf.get();
+  const BinaryIndex * bits = target_is_word ? m_word_bits.get() : m_doc_bits.get();
+  if (filter) {
+    vecs_knn_objs(src, 1, false, &exclude, hits.data(), k, filter);
+  } else if (!hnsw && !ivf && ((!target_is_word && m_doc_pq) || bits)) {
+    auto & target_words = (target_is_word ? m_word_vocab : m_doc_vocab)->getWords();
+    size_t n = approx_knn_objs(src, target_is_word, exclude, hits.data(), k, params);
+    for (size_t b = 0; b < n; b++) hits[b].word = target_words[hits[b].idx].word;
+  } else if (hnsw || ivf) {
+    const real * target_vectors = target_is_word ? m_nn->get_syn0norm() : m_nn->get_dsyn0norm();
+    auto & target_words = (target_is_word ? m_word_vocab : m_doc_vocab)->getWords();
+    size_t n = hnsw ? hnsw->search(target_vectors, src, k + 1, params.hnsw_ef > 0 ? params.hnsw_ef : m_hnsw_ef, hits.data())
+      : ivf->search(target_vectors, src, k + 1, params.ivf_probes > 0 ? params.ivf_probes : m_ivf_nprobe, hits.data());
+    // one more hit than asked for in case the search object comes back
+    auto end = std::remove_if(hits.begin(), hits.begin() + n, [exclude](const knn_hit_t & hit) { return hit.idx == exclude; });
+    n = std::min((size_t)(end - hits.begin()), k);
+    for (size_t b = 0; b < n; b++) hits[b].word = target_words[hits[b].idx].word;
+    for (size_t b = n; b < k; b++) hits[b] = knn_hit_t();
+  } else {
+    vecs_knn_objs(src, 1, target_is_word, &exclude, hits.data(), k);
+  }
+  for (size_t b = 0; b < k; b++) {
+    knns[b].idx = hits[b].idx;
+    knns[b].similarity = hits[b].similarity;
+    knns[b].word = hits[b].word;
+  }
   return true;
 }
 
-bool Model::word_knn_words(const std::string & search, knn_item_t * knns, size_t k)
+bool Model::word_knn_words(const std::string & search, knn_item_t * knns, size_t k, const search_params_t & params)
 {
-  return obj_knn_objs(search, NULL, true, true, knns, k);
+  return obj_knn_objs(search, NULL, true, true, knns, k, params);
 }
 
-bool Model::doc_knn_docs(const std::string & search, knn_item_t * knns, size_t k)
+bool Model::doc_knn_docs(const std::string & search, knn_item_t * knns, size_t k, const search_params_t & params)
 {
-  return obj_knn_objs(search, NULL, false, false, knns, k);
+  return obj_knn_objs(search, NULL, false, false, knns, k, params);
 }
 
-bool Model::word_knn_docs(const std::string & search, knn_item_t * knns, size_t k)
+bool Model::word_knn_docs(const std::string & search, knn_item_t * knns, size_t k, const search_params_t & params)
 {
-  return obj_knn_objs(search, NULL, true, false, knns, k);
+  return obj_knn_objs(search, NULL, true, false, knns, k, params);
 }
 
-void Model::sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k)
+bool Model::sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k)
 {
   std::unique_ptr<real[]> infer_vector(new real[m_nn->dim()]);  
-  sent_knn_words(doc, knns, k, infer_vector.get());  
+  return sent_knn_words(doc, knns, k, infer_vector.get());  
 }
 
-void Model::sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k)
+size_t Model::sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k)
 {
   std::unique_ptr<real[]> infer_vector(new real[m_nn->dim()]);    
-  sent_knn_docs(doc, knns, k, infer_vector.get());
+  return sent_knn_docs(doc, knns, k, infer_vector.get());
+}
+
+bool Model::sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector)
+{
+  infer_doc(doc, infer_vector);
+  return obj_knn_objs("", infer_vector, false, true, knns, k);
 }
 
-void Model::sent_knn_words(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector)
+size_t Model::sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector,
+			    const search_params_t & params)
 {
   infer_doc(doc, infer_vector);
-  obj_knn_objs("", infer_vector, false, true, knns, k);
+  obj_knn_objs("", infer_vector, false, false, knns, k, params);
+  // the padding follows the hits
+  size_t n = 0;
+  while (n < k && knns[n].idx >= 0) n++;
+  return n;
+}
+
+bool Model::doc_knn_docs(const std::string & search, const DocFilter & filter, knn_item_t * knns, size_t k)
+{
+  return obj_knn_objs(search, NULL, false, false, knns, k, search_params_t(), &filter);
 }
 
-void Model::sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k, real * infer_vector)
+bool Model::word_knn_docs(const std::string & search, const DocFilter & filter, knn_item_t * knns, size_t k)
+{
+  return obj_knn_objs(search, NULL, true, false, knns, k, search_params_t(), &filter);
+}
+
+void Model::sent_knn_docs(TaggedDocument & doc, const DocFilter & filter, knn_item_t * knns, size_t k)
+{
+  std::unique_ptr<real[]> infer_vector(new real[m_nn->dim()]);
+  sent_knn_docs(doc, filter, knns, k, infer_vector.get());
+}
+
+void Model::sent_knn_docs(TaggedDocument & doc, const DocFilter & filter, knn_item_t * knns, size_t k, real * infer_vector)
 {
   infer_doc(doc, infer_vector);
-  obj_knn_objs("", infer_vector, false, false, knns, k);
+  obj_knn_objs("", infer_vector, false, false, knns, k, search_params_t(), &filter);
+}
+
+std::shared_ptr<const DocFilter> Model::tagFilter(const std::string & prefix)
+{
+  std::lock_guard<std::mutex> lock(m_tag_filters_mutex);
+  auto & filter = m_tag_filters[prefix];
+  if (!filter) {
+    auto & docs = m_doc_vocab->getWords();
+    auto tagged = std::make_shared<DocFilter>(docs.size());
+    for (size_t a = 0; a < docs.size(); a++) {
+      if (docs[a].word.compare(0, prefix.size(), prefix) == 0) tagged->allow(a);
+    }
+    tagged->ids(); //kept for the document by document plan
+    filter = tagged;
+  }
+  return filter;
+}
+
+bool Model::buildHnsw(size_t m, size_t ef_construction)
+{
+  if (!checkDocVectors("buildHnsw")) return false;
+  fprintf(stderr, "Building HNSW indexes\n");
+  m_word_hnsw = std::make_unique<HnswIndex>(m_nn->dim(), m, ef_construction);
+  m_word_hnsw->add(m_nn->get_syn0norm(), m_nn->m_vocab_size, threadPool());
+  m_doc_hnsw = std::make_unique<HnswIndex>(m_nn->dim(), m, ef_construction);
+  m_doc_hnsw->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  return true;
+}
+
+void Model::saveHnsw(FILE * fout) const
+{
+  for (auto index : {m_word_hnsw.get(), m_doc_hnsw.get()}) {
+    bool present = index != nullptr;
+    fwrite(&present, sizeof(bool), 1, fout);
+    if (present) index->save(fout);
+  }
+}
+
+bool Model::loadHnsw(FILE * fin)
+{
+  std::unique_ptr<HnswIndex> * indexes[] = {&m_word_hnsw, &m_doc_hnsw};
+  size_t sizes[] = {m_nn->m_vocab_size, m_nn->m_corpus_size};
+  for (int a = 0; a < 2; a++) {
+    bool present = false;
+    fread(&present, sizeof(bool), 1, fin);
+    indexes[a]->reset();
+    if (!present) continue;
+    if (a == 1 && !checkDocVectors("loadHnsw")) return false;
+    auto index = std::make_unique<HnswIndex>(m_nn->dim());
+    index->load(fin);
+    if (index->size() != sizes[a] || index->dim() != m_nn->dim()) {
+      fprintf(stderr, "ERROR: HNSW index of %zu vectors does not match the model(%zu)\n", index->size(), sizes[a]);
+      exit(1);
+    }
+    *indexes[a] = std::move(index);
+  }
+  return true;
+}
+
+bool Model::buildIvf(size_t lists, int iterations)
+{
+  if (!checkDocVectors("buildIvf")) return false;
+  if (lists == 0) lists = std::max((size_t)1, (size_t)sqrt((double)m_nn->m_corpus_size));
+  fprintf(stderr, "Building IVF index with %zu lists\n", lists);
+  m_doc_ivf = std::make_unique<IvfIndex>(m_nn->dim());
+  m_doc_ivf->train(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, lists, iterations, threadPool());
+  m_doc_ivf->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  return true;
+}
+
+void Model::saveIvf(FILE * fout) const
+{
+  bool present = m_doc_ivf != nullptr;
+  fwrite(&present, sizeof(bool), 1, fout);
+  if (present) m_doc_ivf->save(fout);
+}
+
+bool Model::loadIvf(FILE * fin)
+{
+  bool present = false;
+  fread(&present, sizeof(bool), 1, fin);
+  m_doc_ivf.reset();
+  if (!present) return true;
+  if (!checkDocVectors("loadIvf")) return false;
+  auto index = std::make_unique<IvfIndex>(m_nn->dim());
+  index->load(fin);
+  if (index->size() != m_nn->m_corpus_size || index->dim() != m_nn->dim()) {
+    fprintf(stderr, "ERROR: IVF index of %zu vectors does not match the model(%zu)\n", index->size(), m_nn->m_corpus_size);
+    exit(1);
+  }
+  m_doc_ivf = std::move(index);
+  return true;
+}
+
+bool Model::buildPq(size_t m, int iterations)
+{
+  if (!checkDocVectors("buildPq")) return false;
+  fprintf(stderr, "Building PQ codes with %zu subspaces\n", m);
+  m_doc_pq = std::make_unique<PqIndex>(m_nn->dim(), m);
+  m_doc_pq->train(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, iterations, threadPool());
+  m_doc_pq->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  return true;
+}
+
+void Model::savePq(FILE * fout) const
+{
+  bool present = m_doc_pq != nullptr;
+  fwrite(&present, sizeof(bool), 1, fout);
+  if (present) m_doc_pq->save(fout);
+}
+
+void Model::loadPq(FILE * fin)
+{
+  bool present = false;
+  fread(&present, sizeof(bool), 1, fin);
+  m_doc_pq.reset();
+  if (!present) return;
+  auto index = std::make_unique<PqIndex>(m_nn->dim());
+  index->load(fin);
+  if (index->size() != m_nn->m_corpus_size || index->dim() != m_nn->dim()) {
+    fprintf(stderr, "ERROR: PQ codes of %zu vectors do not match the model(%zu)\n", index->size(), m_nn->m_corpus_size);
+    exit(1);
+  }
+  m_doc_pq = std::move(index);
+}
+
+bool Model::buildBinary(bool rotate)
+{
+  if (!checkDocVectors("buildBinary")) return false;
+  fprintf(stderr, "Building binary signatures%s\n", rotate ? " of rotated vectors" : "");
+  m_word_bits = std::make_unique<BinaryIndex>(m_nn->dim(), rotate);
+  m_word_bits->add(m_nn->get_syn0norm(), m_nn->m_vocab_size, threadPool());
+  m_doc_bits = std::make_unique<BinaryIndex>(m_nn->dim(), rotate);
+  m_doc_bits->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  return true;
+}
+
+void Model::saveBinary(FILE * fout) const
+{
+  for (auto index : {m_word_bits.get(), m_doc_bits.get()}) {
+    bool present = index != nullptr;
+    fwrite(&present, sizeof(bool), 1, fout);
+    if (present) index->save(fout);
+  }
+}
+
+void Model::loadBinary(FILE * fin)
+{
+  std::unique_ptr<BinaryIndex> * indexes[] = {&m_word_bits, &m_doc_bits};
+  size_t sizes[] = {m_nn->m_vocab_size, m_nn->m_corpus_size};
+  for (int a = 0; a < 2; a++) {
+    bool present = false;
+    fread(&present, sizeof(bool), 1, fin);
+    indexes[a]->reset();
+    if (!present) continue;
+    auto index = std::make_unique<BinaryIndex>();
+    index->load(fin);
+    if (index->size() != sizes[a] || index->dim() != m_nn->dim()) {
+      fprintf(stderr, "ERROR: binary signatures of %zu vectors do not match the model(%zu)\n", index->size(), sizes[a]);
+      exit(1);
+    }
+    *indexes[a] = std::move(index);
+  }
+}
+
+void Model::dropBinary()
+{
+  m_word_bits.reset();
+  m_doc_bits.reset();
+}
+
+bool Model::buildPca()
+{
+  if (!checkDocVectors("buildPca")) return false;
+  fprintf(stderr, "Building PCA rotated vectors\n");
+  m_word_pca = std::make_unique<PcaIndex>(m_nn->dim());
+  m_word_pca->train(m_nn->get_syn0norm(), m_nn->m_vocab_size, threadPool());
+  m_word_pca->add(m_nn->get_syn0norm(), m_nn->m_vocab_size, threadPool());
+  m_doc_pca = std::make_unique<PcaIndex>(m_nn->dim());
+  m_doc_pca->train(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  m_doc_pca->add(m_nn->get_dsyn0norm(), m_nn->m_corpus_size, threadPool());
+  return true;
+}
+
+void Model::dropPca()
+{
+  m_word_pca.reset();
+  m_doc_pca.reset();
+}
+
+void Model::doc_vector(long long idx, real * vec) const
+{
+  size_t dim = m_nn->dim();
+  if (m_nn->get_dsyn0norm()) {
+    std::copy(m_nn->get_dsyn0norm() + idx * dim, m_nn->get_dsyn0norm() + (idx + 1) * dim, vec);
+    return;
+  }
+  off_t offset = m_dsyn0_offset + sizeof(real) * idx * dim;
+  if (pread(m_doc_fd, vec, sizeof(real) * dim, offset) != (ssize_t)(sizeof(real) * dim)) {
+    fprintf(stderr, "ERROR: can't read the vector of document %lld from the model file\n", idx);
+    exit(1);
+  }
+  real len = sqrt(dot(vec, vec, dim));
+  for (size_t d = 0; d < dim; d++) vec[d] /= len;
+}
+
+size_t Model::approx_knn_objs(const real * vec, bool target_is_word, long long exclude,
+			      knn_hit_t * hits, size_t k, const search_params_t & params, const DocFilter * filter)
+{
+  const PqIndex * pq = target_is_word ? nullptr : m_doc_pq.get();
+  const BinaryIndex * bits = target_is_word ? m_word_bits.get() : m_doc_bits.get();
+  size_t rerank = pq ? (params.pq_rerank > 0 ? params.pq_rerank : m_pq_rerank)
+    : (params.binary_rerank > 0 ? params.binary_rerank : m_binary_rerank);
+  // one more candidate than asked for in case the search object comes back
+  size_t candidates = std::max(k + 1, rerank);
+  std::vector<knn_hit_t> found(candidates);
+  size_t n = pq ? pq->search(threadPool(), vec, candidates, found.data(), filter)
+    : bits->search(threadPool(), vec, candidates, found.data());
+  // Hamming distances only pick the candidates, the PQ order may be kept
+  if (rerank > 0 || !pq) {
+    size_t dim = m_nn->dim();
+    std::vector<real> target(dim);
+    for (size_t b = 0; b < n; b++) {
+      if (target_is_word) std::copy(m_nn->get_syn0norm() + found[b].idx * dim, m_nn->get_syn0norm() + (found[b].idx + 1) * dim, target.begin());
+      else doc_vector(found[b].idx, target.data());
+      found[b].similarity = dot(vec, target.data(), dim);
+    }
+    std::sort(found.begin(), found.begin() + n,
+	      [](const knn_hit_t & x, const knn_hit_t & y) { return x.similarity > y.similarity; });
+  }
+  auto end = std::remove_if(found.begin(), found.begin() + n, [exclude](const knn_hit_t & hit) { return hit.idx == exclude; });
+  n = std::min((size_t)(end - found.begin()), k);
+  std::copy(found.begin(), found.begin() + n, hits);
+  for (size_t b = n; b < k; b++) hits[b] = knn_hit_t();
+  return n;
+}
+
+bool Model::checkDocVectors(const char * what) const
+{
+  if (m_doc_fd < 0) return true;
+  fprintf(stderr, "ERROR: %s needs the document vectors, the model was loaded compact\n", what);
+  return false;
+}
+
+bool Model::checkWordVectors(const char * what) const
+{
+  if (m_cbow || m_dbow_words) return true;
+  fprintf(stderr, "ERROR: %s needs trained word vectors, the model is pure PV-DBOW\n", what);
+  return false;
+}
+
+void Model::dropHnsw()
+{
+  m_word_hnsw.reset();
+  m_doc_hnsw.reset();
+}
+
+bool Model::vecs_knn_words(const real * vecs, size_t q, knn_hit_t * hits, size_t k)
+{
+  if (!checkWordVectors("vecs_knn_words")) {
+    std::fill(hits, hits + q * k, knn_hit_t());
+    return false;
+  }
+  vecs_knn_objs(vecs, q, true, NULL, hits, k);
+  return true;
+}
+
+void Model::vecs_knn_docs(const real * vecs, size_t q, knn_hit_t * hits, size_t k)
+{
+  vecs_knn_objs(vecs, q, false, NULL, hits, k);
+}
+
+void Model::vecs_knn_docs(const real * vecs, size_t q, const DocFilter & filter, knn_hit_t * hits, size_t k)
+{
+  vecs_knn_objs(vecs, q, false, NULL, hits, k, &filter);
+}
+
+bool Model::filterDirect(const DocFilter & filter, size_t k) const
+{
+  if (m_nn->get_dsyn0norm()) return filter.count() <= m_filter_direct * m_nn->m_corpus_size;
+  // a compact model reads the re-ranked candidates from the file anyway
+  return !m_doc_pq || filter.count() <= std::max(k + 1, m_pq_rerank);
+}
+
+void Model::direct_knn_docs(const real * vecs, size_t q, const long long * exclude, const DocFilter & filter,
+			    knn_hit_t * hits, size_t k)
+{
+  auto allowed = filter.ids();
+  const std::vector<long long> & ids = *allowed;
+  size_t dim = m_nn->dim();
+  if (m_nn->get_dsyn0norm()) {
+    KnnSearch(m_nn->get_dsyn0norm(), ids.data(), ids.size(), dim).search(threadPool(), vecs, q, k, hits, exclude);
+    return;
+  }
+  // compact model: the allowed vectors read from the file once for all queries
+  std::vector<real> vectors(ids.size() * dim);
+  threadPool().parallel_for(ids.size(), 256, [&](size_t begin, size_t end, size_t) {
+    for (size_t a = begin; a < end; a++) doc_vector(ids[a], &vectors[a * dim]);
+  });
+  std::vector<long long> rows;
+  if (exclude) {
+    rows.resize(q);
+    for (size_t b = 0; b < q; b++) {
+      auto it = std::lower_bound(ids.begin(), ids.end(), exclude[b]);
+      rows[b] = it != ids.end() && *it == exclude[b] ? it - ids.begin() : -1;
+    }
+  }
+  KnnSearch(vectors.data(), ids.size(), dim).search(threadPool(), vecs, q, k, hits, exclude ? rows.data() : NULL);
+  for (size_t b = 0; b < q * k; b++) {
+    if (hits[b].idx >= 0) hits[b].idx = ids[hits[b].idx];
+  }
+}
+
+void Model::vecs_knn_objs(const real * vecs, size_t q, bool target_is_word, const long long * exclude,
+			  knn_hit_t * hits, size_t k, const DocFilter * filter)
+{
+  const real * target_vectors = target_is_word ? m_nn->get_syn0norm() : m_nn->get_dsyn0norm();
+  size_t target_size = target_is_word ? m_nn->m_vocab_size : m_nn->m_corpus_size;
+  auto & target_words = (target_is_word ? m_word_vocab : m_doc_vocab)->getWords();
+  const PcaIndex * pca = target_is_word ? m_word_pca.get() : m_doc_pca.get();
+  const Int8Matrix * quantized = target_is_word ? m_nn->get_syn0q() : m_nn->get_dsyn0q();
+  if (filter && filterDirect(*filter, k)) {
+    direct_knn_docs(vecs, q, exclude, *filter, hits, k);
+  } else if (target_vectors && pca) {
+    pca->search(threadPool(), vecs, q, k, hits, exclude, filter);
+  } else if (target_vectors && quantized) {
+    size_t candidates = std::max(k, m_int8_rerank), dim = m_nn->dim();
+    std::vector<knn_hit_t> found(q * candidates);
+    quantized->search(threadPool(), vecs, q, candidates, found.data(), exclude, filter);
+    threadPool().parallel_for(q, 1, [&](size_t begin, size_t end, size_t) {
+      for (size_t b = begin; b < end; b++) {
+	knn_hit_t * top = &found[b * candidates];
+	size_t n = 0;
+	while (n < candidates && top[n].idx >= 0) {
+	  top[n].similarity = dot(vecs + b * dim, target_vectors + top[n].idx * dim, dim);
+	  n++;
+	}
+	std::sort(top, top + n, [](const knn_hit_t & x, const knn_hit_t & y) { return x.similarity > y.similarity; });
+	std::copy(top, top + k, hits + b * k);
+      }
+    });
+  } else if (target_vectors) {
+    KnnSearch(target_vectors, target_size, m_nn->dim()).search(threadPool(), vecs, q, k, hits, exclude, filter);
+  } else {
+    // compact model: the codes stand in for the document vectors
+    if (!m_doc_pq && !m_doc_bits) {
+      fprintf(stderr, "ERROR: a compact model needs PQ codes or binary signatures of its documents\n");
+      exit(1);
+    }
+    for (size_t b = 0; b < q; b++) approx_knn_objs(vecs + b * m_nn->dim(), false, exclude ? exclude[b] : -1, hits + b * k, k, search_params_t(), filter);
+  }
+  for (size_t b = 0; b < q * k; b++) {
+    if (hits[b].idx >= 0) hits[b].word = target_words[hits[b].idx].word;
+  }
 }
 
 real Model::similarity(const real * src, const real * target) const
 {
-  real dot = 0;
-  for (size_t a = 0; a < m_nn->dim(); a++) dot += src[a] * target[a];
-  return dot;
+  return dot(src, target, m_nn->dim());
 }
 
 real Model::distance(const real * src, const real * target) const
@@ -258,25 +1171,198 @@ real Model::distance(const real * src, const real * target) const
 
 void Model::infer_doc(TaggedDocument & doc, real * vec, int skip)
 {
+  InferenceSession session(*this);
+  session.infer(doc, vec, skip);
+}
+
+void Model::infer_docs(TaggedDocument * docs, size_t n, real * vecs)
+{
+  threadPool().parallel_for(n, 1, [&](size_t begin, size_t end, size_t) {
+    InferenceSession session(*this);
+    for (size_t a = begin; a < end; a++) session.infer(docs[a], &vecs[a * m_nn->dim()]);
+  });
+}
+
+std::vector<knn_item_t> Model::keywords(TaggedDocument & doc)
+{
+  std::vector<long long> ids;
+  m_word_vocab->searchWords(doc.m_words, ids);
+  std::unique_ptr<real[]> weights(new real[ids.size()]);
+  keyword_weights(ids.data(), ids.size(), weights.get());
+  // one item per distinct word, keeping its most important position
+  std::unordered_map<long long, size_t> items;
+  std::vector<knn_item_t> knns;
+  for (size_t a = 0; a < ids.size(); a++) {
+    auto it = items.emplace(ids[a], knns.size());
+    if (it.second) {
+      knns.emplace_back();
+      knns.back().word = m_word_vocab->getWords()[ids[a]].word;
+      knns.back().idx = ids[a];
+      knns.back().similarity = weights[a];
+    } else {
+      knn_item_t & item = knns[it.first->second];
+      item.similarity = std::max(item.similarity, weights[a]);
+    }
+  }
+  std::stable_sort(knns.begin(), knns.end(), [](const knn_item_t & x, const knn_item_t & y) {
+    return x.similarity > y.similarity;
+  });
+  return knns;
+}
+
+void Model::keyword_weights(const long long * ids, size_t n, real * weights)
+{
+  long long dim = m_nn->dim();
+  std::unique_ptr<real[]> raw(new real[dim]);
+  std::unique_ptr<real[]> doc_vector(new real[dim]);
+  InferenceSession session(*this);
+  session.inferRaw(ids, n, raw.get());
   real len = 0;
-  unsigned long long next_random = 1;
-  for (long long a = 0; a < m_nn->dim(); a++) {
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    vec[a] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / m_nn->dim();
+  for (long long a = 0; a < dim; a++) len += raw[a] * raw[a];
+  len = sqrt(len);
+  for (long long a = 0; a < dim; a++) doc_vector[a] = raw[a] / len;
+  threadPool().parallel_for(n, 1, [&](size_t begin, size_t end, size_t) {
+    InferenceSession loo(*this);
+    std::unique_ptr<real[]> vec(new real[dim]);
+    for (size_t a = begin; a < end; a++) {
+      loo.refine(ids, n, raw.get(), vec.get(), m_keyword_passes, a);
+      weights[a] = std::max((real)0, 1 - similarity(doc_vector.get(), vec.get()));
+    }
+  });
+}
+
+void Model::setInferCache(size_t capacity)
+{
+  m_infer_cache.reset(capacity > 0 ? new InferCache(capacity, m_nn ? m_nn->dim() : 0) : nullptr);
+}
+
+void Model::resetQueryState()
+{
+  // vectors changed, derived query state is rebuilt lazily and the indexes by buildHnsw
+  m_sif_once = std::make_unique<std::once_flag>();
+  dropHnsw();
+  dropIvf();
+  dropPq();
+  dropBinary();
+  dropPca();
+  if (m_doc_fd >= 0) close(m_doc_fd);
+  m_doc_fd = -1;
+  m_tag_filters.clear();
+  if (m_infer_cache) m_infer_cache = std::make_unique<InferCache>(m_infer_cache->capacity(), m_nn->dim());
+}
+
+void Model::setSifWeight(real a)
+{
+  m_sif_a = a;
+  m_sif_once = std::make_unique<std::once_flag>();
+}
+
+real Model::sifWeight(long long word_idx) const
+{
+  real p = m_word_vocab->getWords()[word_idx].cn / (real)m_word_vocab->getTrainWords();
+  return m_sif_a / (m_sif_a + p);
+}
+
+real Model::wordWeight(long long word_idx, wmd_weight_t weight) const
+{
+  long long docs = m_word_vocab->getDocs();
+  if (weight == WMD_WEIGHT_IDF && docs > 0) {
+    return log((docs + 1) / (real)(m_word_vocab->getWords()[word_idx].df + 1));
   }
-  m_alpha = m_start_alpha;
-  TrainModelThread trainThread(0, this, NULL, true);
-  trainThread.m_doc_vector = vec;
-  trainThread.buildDocument(doc, skip);
-  for(long long a = 0; a < m_iter; a++)
-  {
-    trainThread.trainDocument();
-    m_alpha = m_start_alpha * (1 - (a + 1.0) / m_iter);
-    m_alpha = MAX(m_alpha, m_start_alpha * 0.0001);
+  return sifWeight(word_idx);
+}
+
+bool Model::sif_doc(TaggedDocument & doc, real * vec)
+{
+  if (!checkWordVectors("sif_doc")) {
+    std::fill(vec, vec + m_nn->dim(), 0);
+    return false;
   }
-  for(long long a = 0; a < m_nn->dim(); a++) len += vec[a] * vec[a];
-  len = sqrt(len);
-  for(long long a = 0; a < m_nn->dim(); a++) vec[a] /= len;
+  const real * syn0norm = m_nn->get_syn0norm();
+  std::fill(vec, vec + m_nn->dim(), 0);
+  for (auto & word : doc.m_words) {
+    long long word_idx = m_word_vocab->searchVocab(word);
+    if (word_idx == -1) continue;
+    if (word_idx == 0) break;
+    real w = sifWeight(word_idx);
+    for (size_t a = 0; a < m_nn->dim(); a++) vec[a] += w * syn0norm[word_idx * m_nn->dim() + a];
+  }
+  sifFinish(vec);
+  return true;
+}
+
+bool Model::sif_doc(const long long * ids, size_t n, real * vec)
+{
+  if (!checkWordVectors("sif_doc")) {
+    std::fill(vec, vec + m_nn->dim(), 0);
+    return false;
+  }
+  const real * syn0norm = m_nn->get_syn0norm();
+  std::fill(vec, vec + m_nn->dim(), 0);
+  for (size_t b = 0; b < n; b++) {
+    real w = sifWeight(ids[b]);
+    for (size_t a = 0; a < m_nn->dim(); a++) vec[a] += w * syn0norm[ids[b] * m_nn->dim() + a];
+  }
+  sifFinish(vec);
+  return true;
+}
+
+void Model::sifFinish(real * vec)
+{
+  // scale doesn't matter, the vector ends up unit length
+  std::call_once(*m_sif_once, &Model::initSifComponent, this);
+  real proj = similarity(vec, m_sif_component.get());
+  for (size_t a = 0; a < m_nn->dim(); a++) vec[a] -= proj * m_sif_component[a];
+  real len = sqrt(similarity(vec, vec));
+  if (len > 0) for (size_t a = 0; a < m_nn->dim(); a++) vec[a] /= len;
+}
+
+void Model::initSifComponent()
+{
+  size_t dim = m_nn->dim();
+  m_sif_component = std::unique_ptr<real[]>(new real[dim]());
+  if (!m_wmd) return;
+  // SIF embeddings of up to 10000 training documents, spread over the corpus
+  const size_t max_docs = 10000;
+  size_t corpus_size = m_nn->m_corpus_size;
+  size_t step = corpus_size > max_docs ? corpus_size / max_docs : 1;
+  const real * syn0norm = m_nn->get_syn0norm();
+  std::vector<real> docs;
+  for (size_t d = 0; d < corpus_size; d += step) {
+    UnWeightedDocument * doc = m_wmd->m_corpus[d];
+    if (!doc || doc->m_words_idx.empty()) continue;
+    docs.resize(docs.size() + dim, 0);
+    real * vec = &docs[docs.size() - dim];
+    for (auto word_idx : doc->m_words_idx) {
+      real w = sifWeight(word_idx);
+      for (size_t a = 0; a < dim; a++) vec[a] += w * syn0norm[word_idx * dim + a];
+    }
+  }
+  size_t n = docs.size() / dim;
+  if (n == 0) return;
+  // power iteration on X^T X
+  std::vector<real> u(dim, 1 / sqrt((real)dim)), next(dim);
+  for (int it = 0; it < 30; it++) {
+    std::fill(next.begin(), next.end(), 0);
+    for (size_t d = 0; d < n; d++) {
+      real proj = similarity(&docs[d * dim], u.data());
+      for (size_t a = 0; a < dim; a++) next[a] += proj * docs[d * dim + a];
+    }
+    real len = sqrt(similarity(next.data(), next.data()));
+    if (len == 0) return;
+    for (size_t a = 0; a < dim; a++) u[a] = next[a] / len;
+  }
+  std::copy(u.begin(), u.end(), m_sif_component.get());
+}
+
+bool Model::vec_knn_words(const real * vec, knn_item_t * knns, size_t k)
+{
+  return obj_knn_objs("", vec, false, true, knns, k);
+}
+
+bool Model::vec_knn_docs(const real * vec, knn_item_t * knns, size_t k)
+{
+  return obj_knn_objs("", vec, false, false, knns, k);
 }
 
 real Model::doc_likelihood(TaggedDocument & doc, int skip)
@@ -289,34 +1375,85 @@ real Model::doc_likelihood(TaggedDocument & doc, int skip)
   return trainThread.doc_likelihood();
 }
 
+void Model::doc_likelihoods(TaggedDocument * docs, size_t n, real * likelihoods)
+{
+  if(!m_hs){
+    std::fill(likelihoods, likelihoods + n, 0);
+    return;
+  }
+  threadPool().parallel_for(n, 1, [&](size_t begin, size_t end, size_t) {
+    TrainModelThread trainThread(0, this, NULL, true);
+    for (size_t a = begin; a < end; a++) {
+      trainThread.buildDocument(docs[a]);
+      likelihoods[a] = trainThread.doc_likelihood();
+    }
+  });
+}
+
 real Model::context_likelihood(TaggedDocument & doc, int sentence_position)
 {
   if(!m_hs){
     return 0;
   }
-  if(m_word_vocab->searchVocab(doc.m_words[sentence_position]) == -1 ||
-     m_word_vocab->searchVocab(doc.m_words[sentence_position]) == 0)
-  {
+  // position among the known words
+  long long sent_pos = 0;
+  for (int i = 0; i < sentence_position; i++) {
+    long long word_idx = m_word_vocab->searchVocab(doc.m_words[i]);
+    if (word_idx == 0) return 0;
+    if (word_idx > 0) sent_pos++;
+  }
+  long long word_idx = m_word_vocab->searchVocab(doc.m_words[sentence_position]);
+  if (word_idx <= 0) {
     return 0;
   }
   TrainModelThread trainThread(0, this, NULL, true);
   trainThread.buildDocument(doc);
+  return trainThread.context_likelihood(sent_pos);
+}
 
-  long long sent_pos = sentence_position;
-  for(int i = 0; i < sentence_position; i++)
-  {
+void Model::context_likelihoods(TaggedDocument & doc, real * likelihoods)
+{
+  std::fill(likelihoods, likelihoods + doc.m_words.size(), 0);
+  if(!m_hs){
+    return;
+  }
+  // one lookup per word, positions of the known words map back to the document
+  std::vector<long long> ids;
+  std::vector<size_t> positions;
+  for (size_t i = 0; i < doc.m_words.size(); i++) {
     long long word_idx = m_word_vocab->searchVocab(doc.m_words[i]);
-    if (word_idx == -1) sent_pos--;
+    if (word_idx == -1) continue;
+    if (word_idx == 0) break;
+    ids.push_back(word_idx);
+    positions.push_back(i);
   }
-  return trainThread.context_likelihood(sent_pos);
+  TrainModelThread trainThread(0, this, NULL, true);
+  trainThread.buildDocument(ids.data(), ids.size());
+  for (size_t a = 0; a < ids.size(); a++) likelihoods[positions[a]] = trainThread.context_likelihood(a);
 }
 
-void Model::save(FILE * fout) const
+bool Model::save(FILE * fout) const
 {
+  if (!checkDocVectors("save")) return false;
   m_word_vocab->save(fout);
   m_doc_vocab->save(fout);
   m_nn->save(fout);
+  saveParams(fout);
+  m_wmd->save(fout);
+  m_nn->saveQuantized(fout);
+  for (auto index : {m_word_pca.get(), m_doc_pca.get()}) {
+    bool present = index != nullptr;
+    fwrite(&present, sizeof(bool), 1, fout);
+    if (present) index->save(fout);
+  }
+  // after the optional sections, older model files end before it
+  int dbow_words = m_dbow_words;
+  fwrite(&dbow_words, sizeof(int), 1, fout);
+  return true;
+}
 
+void Model::saveParams(FILE * fout) const
+{
   int cbow = m_cbow, hs = m_hs;
   
   fwrite(&cbow, sizeof(int), 1, fout);
@@ -326,20 +1463,10 @@ void Model::save(FILE * fout) const
   fwrite(&m_start_alpha, sizeof(real), 1, fout);
   fwrite(&m_sample, sizeof(real), 1, fout);
   fwrite(&m_iter, sizeof(int), 1, fout);
-  m_wmd->save(fout);
 }
 
-void Model::load(FILE * fin)
+void Model::loadParams(FILE * fin)
 {
-  m_word_vocab = std::make_unique<Vocabulary>();
-  m_word_vocab->load(fin);
-  
-  m_doc_vocab = std::make_unique<Vocabulary>();
-  m_doc_vocab->load(fin);
-
-  m_nn = std::make_unique<NN>();
-  m_nn->load(fin);
-
   int cbow, hs;
   fread(&cbow, sizeof(int), 1, fin);
   fread(&hs, sizeof(int), 1, fin);
@@ -351,12 +1478,57 @@ void Model::load(FILE * fin)
 
   m_cbow = cbow;
   m_hs = hs;
+}
+
+void Model::load(FILE * fin, FILE * fpq)
+{
+  m_word_vocab = std::make_unique<Vocabulary>();
+  m_word_vocab->load(fin);
+  
+  m_doc_vocab = std::make_unique<Vocabulary>();
+  m_doc_vocab->load(fin);
+
+  m_nn = std::make_unique<NN>();
+  m_nn->load(fin, fpq ? &m_dsyn0_offset : NULL);
+  loadParams(fin);
   
   initNegTable();
-  m_nn->norm();
+  m_nn->norm(&threadPool());
 
   m_wmd = std::make_unique<WMD>(this);
+  resetQueryState();
   m_wmd->load(fin);
+  m_nn->loadQuantized(fin);
+  // older model files end before the rotated copies, compact loads leave the document copy out
+  std::unique_ptr<PcaIndex> * indexes[] = {&m_word_pca, &m_doc_pca};
+  for (int a = 0; a < 2; a++) {
+    bool present = false;
+    if (fread(&present, sizeof(bool), 1, fin) != 1 || !present) continue;
+    if (fpq && a == 1) {
+      PcaIndex::skip(fin);
+      continue;
+    }
+    *indexes[a] = std::make_unique<PcaIndex>();
+    (*indexes[a])->load(fin);
+  }
+  // models saved without the flag trained their word vectors
+  int dbow_words = 1;
+  fread(&dbow_words, sizeof(int), 1, fin);
+  m_dbow_words = dbow_words;
+  if (!fpq) return;
+  loadPq(fpq);
+  if (!m_doc_pq) {
+    fprintf(stderr, "ERROR: a compact model needs PQ codes of its documents\n");
+    exit(1);
+  }
+  m_doc_fd = dup(fileno(fin));
 }
 
 size_t Model::dim() const { return m_nn->dim(); }
+
+ThreadPool & Model::threadPool()
+{
+  std::lock_guard<std::mutex> lock(*m_pool_mutex);
+  if (!m_pool) m_pool = std::make_shared<ThreadPool>(std::thread::hardware_concurrency());
+  return *m_pool;
+}
@@ -0,0 +1,91 @@
+#include <ModelAverager.h>
+#include <NN.h>
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace doc2vec;
+
+ModelAverager::ModelAverager(NN & nn, int processes)
+  : m_nn(nn), m_processes(processes), m_dim(nn.dim())
+{
+  size_t rows = m_nn.m_vocab_size * ((m_nn.m_hs ? 1 : 0) + (m_nn.m_negative ? 1 : 0) + 1);
+  m_params = rows * m_dim;
+  // layout: barrier | averaged parameters | one replica per process | document vectors
+  size_t header = (sizeof(pthread_barrier_t) + sizeof(real) - 1) / sizeof(real) * sizeof(real);
+  m_map_size = header + sizeof(real) * (m_params * (m_processes + 1) + m_nn.m_corpus_size * m_dim);
+  m_map = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (m_map == MAP_FAILED) {
+    fprintf(stderr, "ERROR: unable to map %zu bytes of shared memory\n", m_map_size);
+    exit(1);
+  }
+  m_process_barrier = (pthread_barrier_t *)m_map;
+  m_avg = (real *)((char *)m_map + header);
+  m_replicas = m_avg + m_params;
+  m_docs = m_replicas + m_params * m_processes;
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(m_process_barrier, &attr, m_processes);
+  pthread_barrierattr_destroy(&attr);
+}
+
+ModelAverager::~ModelAverager()
+{
+  if (m_rank >= 0) {
+    pthread_barrier_destroy(&m_thread_barrier);
+  } else {
+    pthread_barrier_destroy(m_process_barrier);
+  }
+  munmap(m_map, m_map_size);
+}
+
+void ModelAverager::attach(int rank, int threads)
+{
+  m_rank = rank;
+  pthread_barrier_init(&m_thread_barrier, NULL, threads);
+}
+
+void ModelAverager::epochDone()
+{
+  int r = pthread_barrier_wait(&m_thread_barrier);
+  if (r == PTHREAD_BARRIER_SERIAL_THREAD) average();
+  pthread_barrier_wait(&m_thread_barrier);
+}
+
+void ModelAverager::pull()
+{
+  copy(m_avg, true);
+}
+
+void ModelAverager::average()
+{
+  copy(m_replicas + m_params * m_rank, false);
+  pthread_barrier_wait(m_process_barrier);
+  // every process averages its own stripe of the parameters
+  size_t start = m_params * m_rank / m_processes;
+  size_t end = m_params * (m_rank + 1) / m_processes;
+  std::fill(m_avg + start, m_avg + end, 0);
+  for (int p = 0; p < m_processes; p++) {
+    const real * replica = m_replicas + m_params * p;
+    for (size_t a = start; a < end; a++) m_avg[a] += replica[a];
+  }
+  for (size_t a = start; a < end; a++) m_avg[a] /= m_processes;
+  pthread_barrier_wait(m_process_barrier);
+  copy(m_avg, true);
+}
+
+void ModelAverager::copy(real * buf, bool to_nn)
+{
+  size_t size = m_nn.m_vocab_size * m_dim;
+  real * mats[] = { m_nn.get_syn0(), m_nn.get_syn1(), m_nn.get_syn1neg() };
+  for (auto mat : mats) {
+    if (!mat) continue;
+    if (to_nn) std::copy(buf, buf + size, mat);
+    else std::copy(mat, mat + size, buf);
+    buf += size;
+  }
+}
@@ -1,32 +1,33 @@
 #include <NN.h>
+#include <ThreadPool.h>
 
 #include <cmath>
 #include <algorithm>
 
 using namespace doc2vec;
 
+static void init_vectors(real * vectors, size_t size, size_t dim, unsigned long long & next_random)
+{
+  for (size_t a = 0; a < size; a++) {
+    for (size_t b = 0; b < dim; b++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      vectors[a * dim + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / dim;
+    }
+  }
+}
+
 NN::NN(size_t vocab_size, size_t corpus_size, size_t dim, bool hs, int negative)
   : m_hs(hs), m_negative(negative),
-    m_vocab_size(vocab_size), m_corpus_size(corpus_size), m_dim(dim)
+    m_vocab_size(vocab_size), m_corpus_size(corpus_size), m_dim(dim),
+    m_syn0_capacity(vocab_size), m_dsyn0_capacity(corpus_size)
 {
   unsigned long long next_random = 1;
   
   m_syn0 = std::unique_ptr<real[]>(new real[m_vocab_size * m_dim]);
   m_dsyn0 = std::unique_ptr<real[]>(new real[m_corpus_size * m_dim]);
   
-  for (size_t a = 0; a < m_vocab_size; a++) {
-    for (size_t b = 0; b < m_dim; b++) {
-      next_random = next_random * (unsigned long long)25214903917 + 11;
-      m_syn0[a * m_dim + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / m_dim;
-    }
-  }
-  
-  for (size_t a = 0; a < m_corpus_size; a++) {
-    for (size_t b = 0; b < m_dim; b++) {
-      next_random = next_random * (unsigned long long)25214903917 + 11;
-      m_dsyn0[a * m_dim + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / m_dim;
-    }
-  }
+  init_vectors(m_syn0.get(), m_vocab_size, m_dim, next_random);
+  init_vectors(m_dsyn0.get(), m_corpus_size, m_dim, next_random);
 
   if (m_hs) {
     m_syn1 = std::unique_ptr<real[]>(new real[m_vocab_size * m_dim]);
@@ -38,6 +39,50 @@ NN::NN(size_t vocab_size, size_t corpus_size, size_t dim, bool hs, int negative)
   }
 }
 
+NN::NN(const NN & words, size_t corpus_size)
+  : m_hs(words.m_hs), m_negative(words.m_negative),
+    m_vocab_size(words.m_vocab_size), m_corpus_size(corpus_size), m_dim(words.m_dim),
+    m_syn0_capacity(words.m_vocab_size), m_dsyn0_capacity(corpus_size)
+{
+  unsigned long long next_random = 1;
+  size_t size = m_vocab_size * m_dim;
+
+  m_syn0 = std::unique_ptr<real[]>(new real[size]);
+  std::copy(words.m_syn0.get(), words.m_syn0.get() + size, m_syn0.get());
+  m_dsyn0 = std::unique_ptr<real[]>(new real[m_corpus_size * m_dim]);
+  init_vectors(m_dsyn0.get(), m_corpus_size, m_dim, next_random);
+
+  if (m_hs) {
+    m_syn1 = std::unique_ptr<real[]>(new real[size]);
+    std::copy(words.m_syn1.get(), words.m_syn1.get() + size, m_syn1.get());
+  }
+  if (m_negative) {
+    m_syn1neg = std::unique_ptr<real[]>(new real[size]);
+    std::copy(words.m_syn1neg.get(), words.m_syn1neg.get() + size, m_syn1neg.get());
+  }
+}
+
+NN::NN(const NN & other)
+  : m_hs(other.m_hs), m_negative(other.m_negative),
+    m_vocab_size(other.m_vocab_size), m_corpus_size(other.m_corpus_size), m_dim(other.m_dim),
+    m_syn0_capacity(other.m_vocab_size), m_dsyn0_capacity(other.m_corpus_size)
+{
+  size_t size = m_vocab_size * m_dim;
+
+  m_syn0 = std::unique_ptr<real[]>(new real[size]);
+  std::copy(other.m_syn0.get(), other.m_syn0.get() + size, m_syn0.get());
+  m_dsyn0 = std::unique_ptr<real[]>(new real[m_corpus_size * m_dim]);
+  std::copy(other.m_dsyn0.get(), other.m_dsyn0.get() + m_corpus_size * m_dim, m_dsyn0.get());
+  if (m_hs) {
+    m_syn1 = std::unique_ptr<real[]>(new real[size]);
+    std::copy(other.m_syn1.get(), other.m_syn1.get() + size, m_syn1.get());
+  }
+  if (m_negative) {
+    m_syn1neg = std::unique_ptr<real[]>(new real[size]);
+    std::copy(other.m_syn1neg.get(), other.m_syn1neg.get() + size, m_syn1neg.get());
+  }
+}
+
 void NN::save(FILE * fout) const
 {
   int hs = m_hs;
@@ -53,7 +98,7 @@ void NN::save(FILE * fout) const
   if (m_negative) fwrite(m_syn1neg.get(), sizeof(real), m_vocab_size * m_dim, fout);
 }
 
-void NN::load(FILE * fin)
+void NN::load(FILE * fin, long long * dsyn0_offset)
 {
   int hs;
   fread(&hs, sizeof(int), 1, fin);
@@ -63,12 +108,21 @@ void NN::load(FILE * fin)
   fread(&m_dim, sizeof(size_t), 1, fin);
 
   m_hs = hs;
+  m_syn0_capacity = m_vocab_size;
+  m_dsyn0_capacity = m_corpus_size;
 
   m_syn0 = std::unique_ptr<real[]>(new real[m_vocab_size * m_dim]);
   fread(m_syn0.get(), sizeof(real), m_vocab_size * m_dim, fin);
 
-  m_dsyn0 = std::unique_ptr<real[]>(new real[m_corpus_size * m_dim]);
-  fread(m_dsyn0.get(), sizeof(real), m_corpus_size * m_dim, fin);
+  if (dsyn0_offset) {
+    *dsyn0_offset = ftello(fin);
+    fseeko(fin, sizeof(real) * m_corpus_size * m_dim, SEEK_CUR);
+    m_dsyn0.reset(nullptr);
+    m_dsyn0_capacity = 0;
+  } else {
+    m_dsyn0 = std::unique_ptr<real[]>(new real[m_corpus_size * m_dim]);
+    fread(m_dsyn0.get(), sizeof(real), m_corpus_size * m_dim, fin);
+  }
 
   if (m_hs) {
     m_syn1 = std::unique_ptr<real[]>(new real[m_vocab_size * m_dim]);
@@ -85,25 +139,113 @@ void NN::load(FILE * fin)
   }
 }
 
-void NN::norm()
+static void norm_rows(const real * src, real * dst, size_t begin, size_t end, size_t dim)
 {
-  m_syn0norm = std::unique_ptr<real[]>(new real[m_vocab_size * m_dim]);
-  m_dsyn0norm = std::unique_ptr<real[]>(new real[m_corpus_size * m_dim]);
-  
-  for (size_t a = 0; a < m_vocab_size; a++) {
+  for (size_t a = begin; a < end; a++) {
     real len = 0;
-    for (size_t b = 0; b < m_dim; b++) {
-      len += m_syn0[b + a * m_dim] * m_syn0[b + a * m_dim];
+    for (size_t b = 0; b < dim; b++) {
+      len += src[b + a * dim] * src[b + a * dim];
     }
     len = sqrt(len);
-    for (size_t b = 0; b < m_dim; b++) m_syn0norm[b + a * m_dim] = m_syn0[b + a * m_dim] / len;
+    for (size_t b = 0; b < dim; b++) dst[b + a * dim] = src[b + a * dim] / len;
   }
-  for (size_t a = 0; a < m_corpus_size; a++) {
-    real len = 0;
-    for (size_t b = 0; b < m_dim; b++) {
-      len += m_dsyn0[b + a * m_dim] * m_dsyn0[b + a * m_dim];
-    }
-    len = sqrt(len);
-    for (size_t b = 0; b < m_dim; b++) m_dsyn0norm[b + a * m_dim] = m_dsyn0[b + a * m_dim] / len;
+}
+
+void NN::norm(ThreadPool * pool)
+{
+  m_syn0norm = std::unique_ptr<real[]>(new real[m_vocab_size * m_dim]);
+  m_dsyn0norm.reset(m_dsyn0 ? new real[m_dsyn0_capacity * m_dim] : nullptr);
+
+  if (!pool) {
+    norm_rows(m_syn0.get(), m_syn0norm.get(), 0, m_vocab_size, m_dim);
+    if (m_dsyn0) norm_rows(m_dsyn0.get(), m_dsyn0norm.get(), 0, m_corpus_size, m_dim);
+  } else {
+    pool->parallel_for(m_vocab_size, 1024, [this](size_t begin, size_t end, size_t) {
+      norm_rows(m_syn0.get(), m_syn0norm.get(), begin, end, m_dim);
+    });
+    if (m_dsyn0) pool->parallel_for(m_corpus_size, 1024, [this](size_t begin, size_t end, size_t) {
+      norm_rows(m_dsyn0.get(), m_dsyn0norm.get(), begin, end, m_dim);
+    });
   }
+  if (m_syn0q) quantize(true, pool);
+}
+
+void NN::quantize(bool enable, ThreadPool * pool)
+{
+  m_syn0q.reset(enable ? new Int8Matrix(m_dim) : nullptr);
+  m_dsyn0q.reset(enable && m_dsyn0norm ? new Int8Matrix(m_dim) : nullptr);
+  if (m_syn0q) m_syn0q->quantize(m_syn0norm.get(), m_vocab_size, pool);
+  if (m_dsyn0q) m_dsyn0q->quantize(m_dsyn0norm.get(), m_corpus_size, pool);
+}
+
+void NN::saveQuantized(FILE * fout) const
+{
+  int quantized = m_syn0q != nullptr, docs = m_dsyn0q != nullptr;
+  fwrite(&quantized, sizeof(int), 1, fout);
+  if (!quantized) return;
+  fwrite(&docs, sizeof(int), 1, fout);
+  m_syn0q->save(fout);
+  if (docs) m_dsyn0q->save(fout);
+}
+
+void NN::loadQuantized(FILE * fin)
+{
+  int quantized = 0, docs = 0;
+  m_syn0q.reset();
+  m_dsyn0q.reset();
+  if (fread(&quantized, sizeof(int), 1, fin) != 1 || !quantized) return;
+  fread(&docs, sizeof(int), 1, fin);
+  m_syn0q = std::make_unique<Int8Matrix>();
+  m_syn0q->load(fin);
+  if (!docs) return;
+  m_dsyn0q = std::make_unique<Int8Matrix>();
+  m_dsyn0q->load(fin);
+  // a compact load leaves the document vectors on disk, their codes aren't needed either
+  if (!m_dsyn0norm) m_dsyn0q.reset();
+}
+
+// moves the first rows of a matrix into storage of capacity rows
+static void grow_rows(std::unique_ptr<real[]> & mat, size_t rows, size_t capacity, size_t dim)
+{
+  if (!mat) return;
+  std::unique_ptr<real[]> grown(new real[capacity * dim]);
+  std::copy(mat.get(), mat.get() + rows * dim, grown.get());
+  mat = std::move(grown);
+}
+
+void NN::addWords(size_t count)
+{
+  size_t vocab_size = m_vocab_size + count;
+  if (vocab_size > m_syn0_capacity) {
+    size_t capacity = std::max(vocab_size, m_syn0_capacity * 2);
+    grow_rows(m_syn0, m_vocab_size, capacity, m_dim);
+    grow_rows(m_syn1, m_vocab_size, capacity, m_dim);
+    grow_rows(m_syn1neg, m_vocab_size, capacity, m_dim);
+    m_syn0_capacity = capacity;
+  }
+  unsigned long long next_random = m_vocab_size;
+  init_vectors(m_syn0.get() + m_vocab_size * m_dim, count, m_dim, next_random);
+  if (m_syn1) std::fill(m_syn1.get() + m_vocab_size * m_dim, m_syn1.get() + vocab_size * m_dim, 0);
+  if (m_syn1neg) std::fill(m_syn1neg.get() + m_vocab_size * m_dim, m_syn1neg.get() + vocab_size * m_dim, 0);
+  m_vocab_size = vocab_size;
+}
+
+void NN::addDocuments(size_t count)
+{
+  size_t corpus_size = m_corpus_size + count;
+  if (corpus_size > m_dsyn0_capacity) {
+    size_t capacity = std::max(corpus_size, m_dsyn0_capacity * 2);
+    grow_rows(m_dsyn0, m_corpus_size, capacity, m_dim);
+    grow_rows(m_dsyn0norm, m_corpus_size, capacity, m_dim);
+    m_dsyn0_capacity = capacity;
+  }
+  unsigned long long next_random = m_corpus_size;
+  init_vectors(m_dsyn0.get() + m_corpus_size * m_dim, count, m_dim, next_random);
+  m_corpus_size = corpus_size;
+}
+
+void NN::normDocuments(size_t begin)
+{
+  norm_rows(m_dsyn0.get(), m_dsyn0norm.get(), begin, m_corpus_size, m_dim);
+  if (m_dsyn0q) m_dsyn0q->update(m_dsyn0norm.get(), begin, m_corpus_size);
 }
@@ -0,0 +1,231 @@
+#include <PcaIndex.h>
+#include <KnnSearch.h>
+#include <DocFilter.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+using namespace doc2vec;
+
+// dimensions read between two bound checks, rows of a tile
+static const size_t BLOCK = 16;
+static const size_t ROW_TILE = 256;
+// rows of the second moment matrix
+static const size_t MAX_SAMPLE = 100000;
+
+// dot product of one block, inlined into the scan
+static inline real blockDot(const real * a, const real * b, size_t len)
+{
+#if defined(__SSE__)
+  if (len == BLOCK) {
+    __m128 s0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)), _mm_mul_ps(_mm_loadu_ps(a + 4), _mm_loadu_ps(b + 4)));
+    __m128 s1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + 8), _mm_loadu_ps(b + 8)), _mm_mul_ps(_mm_loadu_ps(a + 12), _mm_loadu_ps(b + 12)));
+    s0 = _mm_add_ps(s0, s1);
+    s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+    s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+    return _mm_cvtss_f32(s0);
+  }
+#endif
+  real f = 0;
+  for (size_t d = 0; d < len; d++) f += a[d] * b[d];
+  return f;
+}
+
+size_t PcaIndex::blocks() const
+{
+  return (m_dim + BLOCK - 1) / BLOCK;
+}
+
+// eigenvectors(columns of v) and eigenvalues(diagonal of a) of the symmetric n x n matrix a, cyclic Jacobi
+static void jacobi(std::vector<double> & a, std::vector<double> & v, size_t n)
+{
+  v.assign(n * n, 0);
+  for (size_t i = 0; i < n; i++) v[i * n + i] = 1;
+  for (int sweep = 0; sweep < 50; sweep++) {
+    double off = 0, diag = 0;
+    for (size_t i = 0; i < n; i++) {
+      diag += a[i * n + i] * a[i * n + i];
+      for (size_t j = i + 1; j < n; j++) off += a[i * n + j] * a[i * n + j];
+    }
+    if (off <= 1e-24 * diag) break;
+    for (size_t p = 0; p < n; p++) {
+      for (size_t q = p + 1; q < n; q++) {
+	double apq = a[p * n + q];
+	if (fabs(apq) < 1e-300) continue;
+	double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+	double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+	double c = 1 / sqrt(t * t + 1), s = t * c;
+	for (size_t k = 0; k < n; k++) {
+	  double akp = a[k * n + p], akq = a[k * n + q];
+	  a[k * n + p] = c * akp - s * akq;
+	  a[k * n + q] = s * akp + c * akq;
+	}
+	for (size_t k = 0; k < n; k++) {
+	  double apk = a[p * n + k], aqk = a[q * n + k];
+	  a[p * n + k] = c * apk - s * aqk;
+	  a[q * n + k] = s * apk + c * aqk;
+	}
+	for (size_t k = 0; k < n; k++) {
+	  double vkp = v[k * n + p], vkq = v[k * n + q];
+	  v[k * n + p] = c * vkp - s * vkq;
+	  v[k * n + q] = s * vkp + c * vkq;
+	}
+      }
+    }
+  }
+}
+
+void PcaIndex::train(const real * vectors, size_t rows, ThreadPool & pool)
+{
+  size_t step = rows > MAX_SAMPLE ? rows / MAX_SAMPLE : 1, workers = pool.size();
+  std::vector<double> moments(workers * m_dim * m_dim, 0);
+  pool.parallel_for((rows + step - 1) / step, 1024, [&](size_t begin, size_t end, size_t worker) {
+    double * m = &moments[worker * m_dim * m_dim];
+    for (size_t a = begin; a < end; a++) {
+      const real * vec = vectors + a * step * m_dim;
+      for (size_t i = 0; i < m_dim; i++) {
+	for (size_t j = i; j < m_dim; j++) m[i * m_dim + j] += vec[i] * vec[j];
+      }
+    }
+  });
+  std::vector<double> cov(m_dim * m_dim, 0), axes;
+  for (size_t w = 0; w < workers; w++) {
+    for (size_t a = 0; a < m_dim * m_dim; a++) cov[a] += moments[w * m_dim * m_dim + a];
+  }
+  for (size_t i = 0; i < m_dim; i++) {
+    for (size_t j = 0; j < i; j++) cov[i * m_dim + j] = cov[j * m_dim + i];
+  }
+  jacobi(cov, axes, m_dim);
+  // axes by decreasing variance
+  std::vector<size_t> order(m_dim);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t x, size_t y) { return cov[x * m_dim + x] > cov[y * m_dim + y]; });
+  m_rotation.resize(m_dim * m_dim);
+  for (size_t a = 0; a < m_dim; a++) {
+    for (size_t d = 0; d < m_dim; d++) m_rotation[a * m_dim + d] = axes[d * m_dim + order[a]];
+  }
+  m_rows = 0;
+  m_vectors.clear();
+  m_tails.clear();
+}
+
+void PcaIndex::add(const real * vectors, size_t rows, ThreadPool & pool)
+{
+  if (rows <= m_rows) return;
+  size_t first = m_rows, nb = blocks();
+  m_vectors.resize(rows * m_dim);
+  m_tails.resize(rows * nb);
+  pool.parallel_for(rows - first, 256, [&](size_t begin, size_t end, size_t) {
+    for (size_t a = first + begin; a < first + end; a++) {
+      real * y = &m_vectors[a * m_dim];
+      for (size_t d = 0; d < m_dim; d++) y[d] = dot(&m_rotation[d * m_dim], vectors + a * m_dim, m_dim);
+      real tail = 0;
+      for (size_t b = nb; b > 0; b--) {
+	m_tails[a * nb + b - 1] = sqrt(tail);
+	for (size_t d = (b - 1) * BLOCK; d < std::min(b * BLOCK, m_dim); d++) tail += y[d] * y[d];
+      }
+    }
+  });
+  m_rows = rows;
+}
+
+void PcaIndex::search(ThreadPool & pool, const real * queries, size_t q, size_t k,
+		      knn_hit_t * hits, const long long * exclude, const DocFilter * filter) const
+{
+  if (q == 0 || k == 0) return;
+  size_t nb = blocks();
+  std::vector<real> rotated(q * m_dim), query_tails(q * nb);
+  for (size_t i = 0; i < q; i++) {
+    real * y = &rotated[i * m_dim];
+    for (size_t d = 0; d < m_dim; d++) y[d] = dot(&m_rotation[d * m_dim], queries + i * m_dim, m_dim);
+    real tail = 0;
+    for (size_t b = nb; b > 0; b--) {
+      query_tails[i * nb + b - 1] = sqrt(tail);
+      for (size_t d = (b - 1) * BLOCK; d < std::min(b * BLOCK, m_dim); d++) tail += y[d] * y[d];
+    }
+  }
+  size_t workers = pool.size();
+  std::vector<knn_hit_t> heaps(workers * q * k);
+  std::vector<size_t> counts(workers * q, 0);
+  size_t tiles = (m_rows + ROW_TILE - 1) / ROW_TILE;
+  pool.parallel_for(tiles, 1, [&](size_t begin, size_t end, size_t worker) {
+    knn_hit_t * heap = &heaps[worker * q * k];
+    size_t * count = &counts[worker * q];
+    size_t read = 0;
+    for (size_t t = begin; t < end; t++) {
+      size_t first = t * ROW_TILE, last = std::min(first + ROW_TILE, m_rows);
+      if (filter && !filter->any(first, last)) continue;
+      for (size_t i = 0; i < q; i++) {
+	const real * y = &rotated[i * m_dim], * y_tails = &query_tails[i * nb];
+	knn_hit_t * top = heap + i * k;
+	for (size_t r = first; r < last; r++) {
+	  if ((exclude && exclude[i] == (long long)r) || (filter && !filter->allowed(r))) continue;
+	  const real * x = &m_vectors[r * m_dim], * x_tails = &m_tails[r * nb];
+	  bool full = count[i] == k;
+	  real sim = 0;
+	  size_t d = 0;
+	  for (size_t b = 0; b < nb; b++) {
+	    size_t next = std::min(d + BLOCK, m_dim);
+	    sim += blockDot(y + d, x + d, next - d);
+	    d = next;
+	    // the rest adds at most |y past d| * |x past d|
+	    if (full && b + 1 < nb && sim + y_tails[b] * x_tails[b] < top[0].similarity) break;
+	  }
+	  read += d;
+	  if (d == m_dim) hit_push(top, k, count[i], r, sim);
+	}
+      }
+    }
+    m_dims_read += read;
+  });
+  m_queries += q;
+  for (size_t i = 0; i < q; i++) {
+    knn_hit_t * top = hits + i * k;
+    size_t n = 0;
+    for (size_t w = 0; w < workers; w++) {
+      const knn_hit_t * heap = &heaps[(w * q + i) * k];
+      for (size_t c = 0; c < counts[w * q + i]; c++) hit_push(top, k, n, heap[c].idx, heap[c].similarity);
+    }
+    hit_sort(top, n);
+    for (size_t c = n; c < k; c++) top[c] = knn_hit_t();
+  }
+}
+
+void PcaIndex::save(FILE * fout) const
+{
+  long long dim = m_dim, rows = m_rows;
+  fwrite(&dim, sizeof(long long), 1, fout);
+  fwrite(&rows, sizeof(long long), 1, fout);
+  fwrite(m_rotation.data(), sizeof(real), m_rotation.size(), fout);
+  fwrite(m_vectors.data(), sizeof(real), m_vectors.size(), fout);
+  fwrite(m_tails.data(), sizeof(real), m_tails.size(), fout);
+}
+
+void PcaIndex::load(FILE * fin)
+{
+  long long dim, rows;
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&rows, sizeof(long long), 1, fin);
+  m_dim = dim;
+  m_rows = rows;
+  m_rotation.resize(m_dim * m_dim);
+  fread(m_rotation.data(), sizeof(real), m_rotation.size(), fin);
+  m_vectors.resize(m_rows * m_dim);
+  fread(m_vectors.data(), sizeof(real), m_vectors.size(), fin);
+  m_tails.resize(m_rows * blocks());
+  fread(m_tails.data(), sizeof(real), m_tails.size(), fin);
+}
+
+void PcaIndex::skip(FILE * fin)
+{
+  long long dim, rows;
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&rows, sizeof(long long), 1, fin);
+  PcaIndex index(dim);
+  fseeko(fin, sizeof(real) * (dim * dim + rows * dim + rows * index.blocks()), SEEK_CUR);
+}
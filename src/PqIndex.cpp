@@ -0,0 +1,198 @@
+#include <PqIndex.h>
+#include <KnnSearch.h>
+#include <DocFilter.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace doc2vec;
+
+static const size_t CENTROIDS = 256;
+// rows whose codes are interleaved, one 8 byte load per subspace
+static const size_t ROW_BLOCK = 8;
+// training rows per centroid
+static const size_t SAMPLE_PER_CENTROID = 32;
+
+unsigned char PqIndex::nearest(size_t s, const real * vec) const
+{
+  size_t first = begin(s), len = begin(s + 1) - first;
+  const real * centroids = &m_centroids[CENTROIDS * first];
+  const real * sub = vec + first;
+  size_t best = 0;
+  real best_dis = std::numeric_limits<real>::max();
+  for (size_t c = 0; c < CENTROIDS; c++) {
+    const real * centroid = centroids + c * len;
+    real dis = 0;
+    for (size_t d = 0; d < len; d++) dis += (sub[d] - centroid[d]) * (sub[d] - centroid[d]);
+    if (dis < best_dis) {
+      best_dis = dis;
+      best = c;
+    }
+  }
+  return best;
+}
+
+void PqIndex::train(const real * vectors, size_t rows, int iterations, ThreadPool & pool)
+{
+  m_m = std::max((size_t)1, std::min(m_m, m_dim));
+  std::vector<long long> sample(std::min(rows, CENTROIDS * SAMPLE_PER_CENTROID));
+  unsigned long long next_random = 1;
+  for (size_t a = 0; a < sample.size(); a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    sample[a] = sample.size() == rows ? a : (next_random >> 16) % rows;
+  }
+  if (sample.size() == rows) {
+    for (size_t a = sample.size() - 1; a > 0; a--) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      std::swap(sample[a], sample[(next_random >> 16) % (a + 1)]);
+    }
+  }
+  m_centroids.assign(CENTROIDS * m_dim, 0);
+  if (sample.empty()) return;
+  pool.parallel_for(m_m, 1, [&](size_t s_begin, size_t s_end, size_t) {
+    std::vector<unsigned char> assign(sample.size());
+    std::vector<size_t> counts(CENTROIDS);
+    for (size_t s = s_begin; s < s_end; s++) {
+      size_t first = begin(s), len = begin(s + 1) - first;
+      real * centroids = &m_centroids[CENTROIDS * first];
+      for (size_t c = 0; c < CENTROIDS; c++) {
+	const real * vec = vectors + sample[c % sample.size()] * m_dim + first;
+	std::copy(vec, vec + len, centroids + c * len);
+      }
+      unsigned long long subspace_random = s + 1;
+      for (int it = 0; it < iterations; it++) {
+	for (size_t a = 0; a < sample.size(); a++) assign[a] = nearest(s, vectors + sample[a] * m_dim);
+	std::fill(centroids, centroids + CENTROIDS * len, 0);
+	std::fill(counts.begin(), counts.end(), 0);
+	for (size_t a = 0; a < sample.size(); a++) {
+	  const real * vec = vectors + sample[a] * m_dim + first;
+	  real * centroid = centroids + assign[a] * len;
+	  for (size_t d = 0; d < len; d++) centroid[d] += vec[d];
+	  counts[assign[a]]++;
+	}
+	for (size_t c = 0; c < CENTROIDS; c++) {
+	  real * centroid = centroids + c * len;
+	  if (counts[c] == 0) {
+	    // empty cluster: restart from a random sample row
+	    subspace_random = subspace_random * (unsigned long long)25214903917 + 11;
+	    const real * vec = vectors + sample[(subspace_random >> 16) % sample.size()] * m_dim + first;
+	    std::copy(vec, vec + len, centroid);
+	    continue;
+	  }
+	  for (size_t d = 0; d < len; d++) centroid[d] /= counts[c];
+	}
+      }
+    }
+  });
+  m_rows = 0;
+  m_codes.clear();
+}
+
+void PqIndex::add(const real * vectors, size_t rows, ThreadPool & pool)
+{
+  if (rows <= m_rows) return;
+  size_t first = m_rows;
+  m_codes.resize((rows + ROW_BLOCK - 1) / ROW_BLOCK * ROW_BLOCK * m_m, 0);
+  pool.parallel_for(rows - first, 256, [&](size_t a_begin, size_t a_end, size_t) {
+    for (size_t a = first + a_begin; a < first + a_end; a++) {
+      unsigned char * block = &m_codes[a / ROW_BLOCK * ROW_BLOCK * m_m];
+      for (size_t s = 0; s < m_m; s++) block[s * ROW_BLOCK + a % ROW_BLOCK] = nearest(s, vectors + a * m_dim);
+    }
+  });
+  m_rows = rows;
+}
+
+// approximate inner products of the ROW_BLOCK rows of a block from the lookup table
+static inline void scoreBlock(const real * table, const unsigned char * block, size_t m, real * sims)
+{
+#if defined(__AVX2__)
+  __m256 acc = _mm256_setzero_ps();
+  for (size_t s = 0; s < m; s++) {
+    __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(block + s * ROW_BLOCK)));
+    acc = _mm256_add_ps(acc, _mm256_i32gather_ps(table + s * 256, idx, sizeof(real)));
+  }
+  _mm256_storeu_ps(sims, acc);
+#else
+  real f[ROW_BLOCK] = {0};
+  for (size_t s = 0; s < m; s++) {
+    const real * t = table + s * 256;
+    const unsigned char * codes = block + s * ROW_BLOCK;
+    for (size_t i = 0; i < ROW_BLOCK; i++) f[i] += t[codes[i]];
+  }
+  std::copy(f, f + ROW_BLOCK, sims);
+#endif
+}
+
+size_t PqIndex::search(ThreadPool & pool, const real * query, size_t k, knn_hit_t * hits,
+		       const DocFilter * filter) const
+{
+  if (k == 0 || m_rows == 0) return 0;
+  // table of the inner products of the query subspaces with every centroid
+  std::vector<real> table(m_m * CENTROIDS);
+  for (size_t s = 0; s < m_m; s++) {
+    size_t first = begin(s), len = begin(s + 1) - first;
+    const real * centroids = &m_centroids[CENTROIDS * first];
+    for (size_t c = 0; c < CENTROIDS; c++) table[s * CENTROIDS + c] = dot(query + first, centroids + c * len, len);
+  }
+  size_t workers = pool.size(), blocks = (m_rows + ROW_BLOCK - 1) / ROW_BLOCK;
+  std::vector<knn_hit_t> heaps(workers * k);
+  std::vector<size_t> counts(workers, 0);
+  pool.parallel_for(blocks, 64, [&](size_t b_begin, size_t b_end, size_t worker) {
+    knn_hit_t * heap = &heaps[worker * k];
+    real sims[ROW_BLOCK];
+    for (size_t b = b_begin; b < b_end; b++) {
+      size_t first = b * ROW_BLOCK, rows = std::min(ROW_BLOCK, m_rows - first);
+      if (filter && !filter->any(first, first + rows)) continue;
+      scoreBlock(table.data(), &m_codes[first * m_m], m_m, sims);
+      for (size_t i = 0; i < rows; i++) {
+	if (!filter || filter->allowed(first + i)) hit_push(heap, k, counts[worker], first + i, sims[i]);
+      }
+    }
+  });
+  size_t n = 0;
+  for (size_t w = 0; w < workers; w++) {
+    for (size_t c = 0; c < counts[w]; c++) hit_push(hits, k, n, heaps[w * k + c].idx, heaps[w * k + c].similarity);
+  }
+  hit_sort(hits, n);
+  return n;
+}
+
+void PqIndex::decode(size_t row, real * vec) const
+{
+  const unsigned char * block = &m_codes[row / ROW_BLOCK * ROW_BLOCK * m_m];
+  for (size_t s = 0; s < m_m; s++) {
+    size_t first = begin(s), len = begin(s + 1) - first;
+    const real * centroid = &m_centroids[CENTROIDS * first + block[s * ROW_BLOCK + row % ROW_BLOCK] * len];
+    std::copy(centroid, centroid + len, vec + first);
+  }
+}
+
+void PqIndex::save(FILE * fout) const
+{
+  long long dim = m_dim, m = m_m, rows = m_rows;
+  fwrite(&dim, sizeof(long long), 1, fout);
+  fwrite(&m, sizeof(long long), 1, fout);
+  fwrite(&rows, sizeof(long long), 1, fout);
+  fwrite(m_centroids.data(), sizeof(real), m_centroids.size(), fout);
+  fwrite(m_codes.data(), 1, m_codes.size(), fout);
+}
+
+void PqIndex::load(FILE * fin)
+{
+  long long dim, m, rows;
+  fread(&dim, sizeof(long long), 1, fin);
+  fread(&m, sizeof(long long), 1, fin);
+  fread(&rows, sizeof(long long), 1, fin);
+  m_dim = dim;
+  m_m = m;
+  m_rows = rows;
+  m_centroids.resize(CENTROIDS * m_dim);
+  fread(m_centroids.data(), sizeof(real), m_centroids.size(), fin);
+  m_codes.resize((m_rows + ROW_BLOCK - 1) / ROW_BLOCK * ROW_BLOCK * m_m);
+  fread(m_codes.data(), 1, m_codes.size(), fin);
+}
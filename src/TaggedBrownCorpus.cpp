@@ -75,19 +75,17 @@ void UnWeightedDocument::load(FILE * fin)
 WeightedDocument::WeightedDocument(Model * doc2vec, TaggedDocument * doc)
   : UnWeightedDocument(doc2vec, doc)
 {
-  long long word_idx;
   std::unordered_map<long long, real> scores;
-  std::unique_ptr<real[]> doc_vector(new real[doc2vec->nn().dim()]);
-  std::unique_ptr<real[]> infer_vector(new real[doc2vec->nn().dim()]);
-  doc2vec->infer_doc(*doc, doc_vector.get());
-  for (size_t a = 0; a < doc->m_words.size(); a++) {
-    auto & word = doc->m_words[a];
-    word_idx = doc2vec->wvocab().searchVocab(word);
-    if (word_idx == -1) continue;
-    if (word_idx == 0) break;
-    doc2vec->infer_doc(*doc, infer_vector.get(), a);
-    real sim = doc2vec->similarity(doc_vector.get(), infer_vector.get());
-    scores[word_idx] = pow(1.0 - sim, 1.5);
+  // words are looked up once, leave-one-out weights are computed by position
+  std::vector<long long> ids;
+  doc2vec->wvocab().searchWords(doc->m_words, ids);
+  if (doc2vec->wmdWeight() == WMD_WEIGHT_LOO) {
+    std::unique_ptr<real[]> weights(new real[ids.size()]);
+    doc2vec->keyword_weights(ids.data(), ids.size(), weights.get());
+    for (size_t a = 0; a < ids.size(); a++) scores[ids[a]] = pow(weights[a], 1.5);
+  } else {
+    // corpus statistics, summed over the occurrences of a word
+    for (auto & idx : ids) scores[idx] += doc2vec->wordWeight(idx, doc2vec->wmdWeight());
   }
 
   real sum = 0;
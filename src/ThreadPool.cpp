@@ -0,0 +1,114 @@
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace doc2vec;
+
+// gang item running on this thread, scratch of this thread
+static thread_local bool in_gang = false;
+static thread_local std::vector<real> thread_scratch;
+
+ThreadPool::ThreadPool(size_t threads)
+  : m_size(threads > 0 ? threads : 1)
+{
+  add(m_size);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (auto & worker : m_workers) worker.join();
+}
+
+void ThreadPool::add(size_t threads)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  while (m_workers.size() < threads) m_workers.emplace_back(&ThreadPool::work, this);
+}
+
+void ThreadPool::drain(job_t & job, std::unique_lock<std::mutex> & lock)
+{
+  size_t worker = job.joined++;
+  while (job.next < job.n) {
+    size_t begin = job.next;
+    size_t end = std::min(begin + job.chunk, job.n);
+    job.next = end;
+    // all chunks handed out, no one else joins
+    if (end == job.n) m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+    lock.unlock();
+    (*job.fn)(begin, end, worker);
+    lock.lock();
+    if (--job.pending == 0) m_done.notify_all();
+  }
+}
+
+void ThreadPool::run(job_t & job)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_jobs.push_back(&job);
+  m_wake.notify_all();
+  drain(job, lock);
+  m_done.wait(lock, [&job]() { return job.pending == 0; });
+}
+
+void ThreadPool::parallel_for(size_t n, size_t grain, const std::function<void(size_t, size_t, size_t)> & fn)
+{
+  if (n == 0) return;
+  job_t job;
+  job.fn = &fn;
+  job.n = n;
+  job.chunk = std::max(n / (m_size * 4) + 1, grain);
+  job.pending = (n + job.chunk - 1) / job.chunk;
+  job.workers = m_size;
+  run(job);
+}
+
+void ThreadPool::gang(size_t n, const std::function<void(size_t)> & fn)
+{
+  if (n == 0) return;
+  if (in_gang) {
+    fprintf(stderr, "ERROR: training can't be started from a training thread\n");
+    exit(1);
+  }
+  std::lock_guard<std::mutex> one(m_gang_mutex);
+  // the caller takes one item; workers busy with other calls come back, other gangs are done
+  add(n - 1);
+  std::function<void(size_t, size_t, size_t)> items = [&fn](size_t begin, size_t end, size_t) {
+    in_gang = true;
+    for (size_t a = begin; a < end; a++) fn(a);
+    in_gang = false;
+  };
+  job_t job;
+  job.fn = &items;
+  job.n = n;
+  job.chunk = 1;
+  job.pending = n;
+  job.workers = n;
+  run(job);
+}
+
+real * ThreadPool::scratch(size_t size)
+{
+  if (thread_scratch.size() < size) thread_scratch.resize(size);
+  return thread_scratch.data();
+}
+
+void ThreadPool::work()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    job_t * job = nullptr;
+    m_wake.wait(lock, [this, &job]() {
+      for (auto j : m_jobs) if (j->joined < j->workers) { job = j; break; }
+      return m_stop || job;
+    });
+    if (m_stop) return;
+    drain(*job, lock);
+  }
+}
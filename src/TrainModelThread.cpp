@@ -8,41 +8,90 @@
 
 using namespace doc2vec;
 
+// rows of a Huffman path are far apart in syn1, fetch the next one while the current one is used
+static inline void prefetch_row(const real * row, long long size)
+{
+  for (long long c = 0; c < size; c += 64 / sizeof(real)) __builtin_prefetch(row + c);
+}
+
+// independent partial sums, which compilers vectorize without reassociating a single sum
+static inline real dot(const real * a, const real * b, long long size)
+{
+  real s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  long long c = 0;
+  for (; c + 8 <= size; c += 8) {
+    for (int d = 0; d < 8; d++) s[d] += a[c + d] * b[c + d];
+  }
+  for (; c < size; c++) s[0] += a[c] * b[c];
+  return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+}
+
 TrainModelThread::TrainModelThread(long long id, Model * doc2vec,
 				   std::unique_ptr<TaggedBrownCorpus> sub_corpus, bool infer)
   : m_id(id), m_doc2vec(doc2vec), m_corpus(std::move(sub_corpus)), m_infer(infer)
 {
+  m_update_words = !m_infer && !doc2vec->m_freeze_words;
   m_start = clock();
   m_next_random = id;
+  m_alpha = doc2vec->m_alpha;
   m_word_count = 0;
   m_last_word_count = 0;
 
-  m_neu1 = std::unique_ptr<real[]>(new real[doc2vec->nn().dim()]);
-  m_neu1e = std::unique_ptr<real[]>(new real[doc2vec->nn().dim()]);
+  m_neu1 = m_neu1e = nullptr;
+  if (m_infer) {
+    m_scratch = std::unique_ptr<real[]>(new real[doc2vec->nn().dim() * 2]);
+    useScratch(m_scratch.get());
+  }
+}
+
+void TrainModelThread::useScratch(real * scratch)
+{
+  m_neu1 = scratch;
+  m_neu1e = scratch + m_doc2vec->nn().dim();
 }
 
 void TrainModelThread::train()
 {
   TaggedDocument * doc = NULL;
-  for(int local_iter = 0; local_iter < m_doc2vec->iter(); local_iter++)
+  bool first_epoch = true;
+  for(; m_local_iter < m_doc2vec->m_train_iter; m_local_iter++)
   {
     while((doc = m_corpus->next()) != NULL)
     {
       updateLR();
+      m_alpha = m_doc2vec->m_alpha;
       buildDocument(*doc);
       if(!m_doc_vector) continue;
+      //held-out documents only train their own vector
+      bool holdout = m_doc2vec->isHoldout(m_doc_idx);
+      if(holdout && first_epoch) m_holdout_docs.push_back(m_sen_nosample);
+      m_update_words = !m_doc2vec->m_freeze_words && !holdout;
       trainDocument();
     }
+    first_epoch = false;
     m_corpus->rewind();
     m_doc2vec->updateWordCountActual(m_word_count - m_last_word_count);
     m_word_count = 0;
     m_last_word_count = 0;
+    if(m_doc2vec->m_averager) m_doc2vec->m_averager->epochDone();
+    if(m_doc2vec->m_epoch_sync) m_doc2vec->epochDone(this);
+  }
+}
+
+void TrainModelThread::holdoutLikelihood()
+{
+  m_holdout_likelihood = 0;
+  m_holdout_words = 0;
+  for (auto & sen : m_holdout_docs) {
+    m_sen_nosample = sen;
+    m_holdout_likelihood += doc_likelihood();
+    m_holdout_words += sen.size();
   }
 }
 
 void TrainModelThread::updateLR()
 {
-  long long train_words = m_doc2vec->wvocab().getTrainWords();
+  long long train_words = m_doc2vec->m_train_words;
   if (m_word_count - m_last_word_count > 10000) { //statistics speed per 10000 words, and update learning rate
     m_doc2vec->updateWordCountActual(m_word_count - m_last_word_count);
     m_last_word_count = m_word_count;
@@ -51,7 +100,8 @@ void TrainModelThread::updateLR()
 	    m_doc2vec->m_word_count_actual / (real)(m_doc2vec->iter() * train_words + 1) * 100,
 	    m_doc2vec->m_word_count_actual / ((real)(now - m_start + 1) / (real)CLOCKS_PER_SEC * 1000));
     fflush(stderr);
-    m_doc2vec->setAlpha(m_doc2vec->m_start_alpha * (1 - m_doc2vec->m_word_count_actual / (real)(m_doc2vec->iter() * train_words + 1)));
+    m_doc2vec->setAlpha(m_doc2vec->m_lr_alpha * (1 - (m_doc2vec->m_word_count_actual - m_doc2vec->m_lr_start_words) /
+						 (real)(m_doc2vec->m_lr_end_words - m_doc2vec->m_lr_start_words + 1)));
     m_doc2vec->setAlpha(MAX(m_doc2vec->getAlpha(), m_doc2vec->getStartAlpha() * 0.0001));
   }
 }
@@ -60,25 +110,28 @@ void TrainModelThread::buildDocument(TaggedDocument & doc, int skip)
 {
   if(!m_infer) {
     m_doc_vector = nullptr;
-    long long doc_idx = m_doc2vec->dvocab().searchVocab(doc.m_tag);
-    if(doc_idx < 0) {
+    m_doc_idx = m_doc2vec->dvocab().searchVocab(doc.m_tag);
+    if(m_doc_idx < 0 || m_doc_idx < m_doc2vec->m_first_train_doc) {
       return;
     }
-    m_doc_vector = &(m_doc2vec->nn().get_dsyn0()[m_doc2vec->nn().dim() * doc_idx]);
+    m_doc_vector = &(m_doc2vec->nn().get_dsyn0()[m_doc2vec->nn().dim() * m_doc_idx]);
   }
+  m_ids.clear();
+  m_doc2vec->wvocab().searchWords(doc.m_words, m_ids, skip);
+  buildDocument(m_ids.data(), m_ids.size());
+}
+
+void TrainModelThread::buildDocument(const long long * ids, size_t n, long long skip)
+{
   m_sen.clear();
   m_sen_nosample.clear();
   auto & words = m_doc2vec->wvocab().getWords();
-  for (size_t i = 0; i < doc.m_words.size(); i++) {
-    if ((ssize_t)i != skip) {
-      long long word_idx = m_doc2vec->wvocab().searchVocab(doc.m_words[i]);
-      if (word_idx == -1) continue;
-      if (word_idx == 0) break;
-      m_word_count++;
-      m_sen_nosample.push_back(word_idx);
-      if (!down_sample(words[word_idx].cn)) {
-	m_sen.push_back(word_idx);
-      }
+  for (size_t i = 0; i < n; i++) {
+    if ((long long)i == skip) continue;
+    m_word_count++;
+    m_sen_nosample.push_back(ids[i]);
+    if (!down_sample(words[ids[i]].cn)) {
+      m_sen.push_back(ids[i]);
     }
   }
 }
@@ -110,13 +163,14 @@ void TrainModelThread::trainSampleCbow(long long central, long long context_star
     for (d = 0; d < vocab[central_word].codelen; d++) {
       real f = 0;
       l2 = vocab[central_word].point[d] * layer1_size;
+      if (d + 1 < vocab[central_word].codelen) prefetch_row(&syn1[vocab[central_word].point[d + 1] * layer1_size], layer1_size);
       for (c = 0; c < layer1_size; c++) f += m_neu1[c] * syn1[c + l2];
       if (f <= -MAX_EXP) continue;
       else if (f >= MAX_EXP) continue;
       else f = m_doc2vec->m_expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-      real g = (1 - vocab[central_word].code[d] - f) * m_doc2vec->m_alpha;
+      real g = (1 - vocab[central_word].code[d] - f) * m_alpha;
       for (c = 0; c < layer1_size; c++) m_neu1e[c] += g * syn1[c + l2];
-      if (!m_infer) for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * m_neu1[c];
+      if (m_update_words) for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * m_neu1[c];
     }
   }
   //negative sampling
@@ -133,14 +187,14 @@ void TrainModelThread::trainSampleCbow(long long central, long long context_star
       l2 = target * layer1_size;
       real f = 0, g = 0;      
       for (c = 0; c < layer1_size; c++) f += m_neu1[c] * syn1neg[c + l2];
-      if (f > MAX_EXP) g = (label - 1) * m_doc2vec->m_alpha;
-      else if (f < -MAX_EXP) g = (label - 0) * m_doc2vec->m_alpha;
-      else g = (label - m_doc2vec->m_expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * m_doc2vec->m_alpha;
+      if (f > MAX_EXP) g = (label - 1) * m_alpha;
+      else if (f < -MAX_EXP) g = (label - 0) * m_alpha;
+      else g = (label - m_doc2vec->m_expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * m_alpha;
       for (c = 0; c < layer1_size; c++) m_neu1e[c] += g * syn1neg[c + l2];
-      if(!m_infer) for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * m_neu1[c];
+      if(m_update_words) for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * m_neu1[c];
     }
   }
-  if (!m_infer) {
+  if (m_update_words) {
     for (long long a = context_start; a < context_end; a++) {
       if (a != central)	{
 	last_word = m_sen[a];
@@ -164,13 +218,14 @@ void TrainModelThread::trainPairSg(long long central_word, real * context)
     for (d = 0; d < vocab[central_word].codelen; d++) {
       real f = 0;
       l2 = vocab[central_word].point[d] * layer1_size;
+      if (d + 1 < vocab[central_word].codelen) prefetch_row(&syn1[vocab[central_word].point[d + 1] * layer1_size], layer1_size);
       for (c = 0; c < layer1_size; c++) f += context[c] * syn1[c + l2];
       if (f <= -MAX_EXP) continue;
       else if (f >= MAX_EXP) continue;
       else f = m_doc2vec->m_expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-      real g = (1 - vocab[central_word].code[d] - f) * m_doc2vec->m_alpha;
+      real g = (1 - vocab[central_word].code[d] - f) * m_alpha;
       for (c = 0; c < layer1_size; c++) m_neu1e[c] += g * syn1[c + l2];
-      if(!m_infer) for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * context[c];
+      if(m_update_words) for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * context[c];
     }
   }
   //negative sampling
@@ -187,11 +242,11 @@ void TrainModelThread::trainPairSg(long long central_word, real * context)
       l2 = target * layer1_size;
       real f = 0, g = 0;
       for (c = 0; c < layer1_size; c++) f += context[c] * syn1neg[c + l2];
-      if (f > MAX_EXP) g = (label - 1) * m_doc2vec->m_alpha;
-      else if (f < -MAX_EXP) g = (label - 0) * m_doc2vec->m_alpha;
-      else g = (label - m_doc2vec->m_expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * m_doc2vec->m_alpha;
+      if (f > MAX_EXP) g = (label - 1) * m_alpha;
+      else if (f < -MAX_EXP) g = (label - 0) * m_alpha;
+      else g = (label - m_doc2vec->m_expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * m_alpha;
       for (c = 0; c < layer1_size; c++) m_neu1e[c] += g * syn1neg[c + l2];
-      if(!m_infer) for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * context[c];
+      if(m_update_words) for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * context[c];
     }
   }
   for (c = 0; c < layer1_size; c++) context[c] += m_neu1e[c];
@@ -209,7 +264,9 @@ void TrainModelThread::trainSampleSg(long long central, long long context_start,
 
 void TrainModelThread::trainDocument()
 {
-  for(long long sentence_position = 0; sentence_position < m_sen.size(); sentence_position++)
+  //pure PV-DBOW(and skip-gram with frozen words) never touches the word windows
+  bool train_windows = m_doc2vec->m_cbow || (m_update_words && m_doc2vec->m_dbow_words);
+  for(long long sentence_position = 0; train_windows && sentence_position < m_sen.size(); sentence_position++)
   {
     m_next_random = m_next_random * (unsigned long long)25214903917 + 11;
     long long b = m_next_random % m_doc2vec->m_window;
@@ -221,7 +278,7 @@ void TrainModelThread::trainDocument()
     }
     else
     {
-      if(!m_infer) trainSampleSg(sentence_position, context_start, context_end);
+      trainSampleSg(sentence_position, context_start, context_end);
     }
   }
   if(!m_doc2vec->m_cbow)
@@ -269,7 +326,7 @@ real TrainModelThread::context_likelihood(long long sentence_position)
   auto syn0 = m_doc2vec->nn().get_syn0();
   long long layer1_size = m_doc2vec->nn().dim();
   long long context_start = MAX(0LL, sentence_position - m_doc2vec->m_window);
-  long long context_end = MIN(sentence_position + m_doc2vec->m_window + 1, m_sen.size());
+  long long context_end = MIN(sentence_position + m_doc2vec->m_window + 1, m_sen_nosample.size());
   if (m_doc2vec->m_cbow) {
     // mean vector
     for (long long c = 0; c < layer1_size; c++) m_neu1[c] = 0;
@@ -281,12 +338,13 @@ real TrainModelThread::context_likelihood(long long sentence_position)
 	cw++;
       }
     }
+    if (cw == 0) return 0;
     for (long long c = 0; c < layer1_size; c++) m_neu1[c] /= cw;
-    likelihood += likelihoodPair(m_sen_nosample[sentence_position], m_neu1.get());
+    likelihood += likelihoodPair(m_sen_nosample[sentence_position], m_neu1);
   } else {
     for (long long a = context_start; a < context_end; a++) {
       if (sentence_position != a) {
-	real * context_vector = &(syn0[layer1_size * a]);
+	real * context_vector = &(syn0[layer1_size * m_sen_nosample[a]]);
 	likelihood += likelihoodPair(m_sen_nosample[sentence_position], context_vector);
       }
     }
@@ -296,17 +354,18 @@ real TrainModelThread::context_likelihood(long long sentence_position)
 
 real TrainModelThread::likelihoodPair(long long central, real * context_vector)
 {
-  long long c, d, l2, label;
-  real likelihood = 0, f = 0;
+  long long d, l2, label;
+  real likelihood = 0, f;
   long long layer1_size = m_doc2vec->nn().dim();
   auto syn1 = m_doc2vec->nn().get_syn1();
   auto & vocab = m_doc2vec->wvocab().getWords();
   for (d = 0; d < vocab[central].codelen; d++){
     l2 = vocab[central].point[d] * layer1_size;
+    if (d + 1 < vocab[central].codelen) prefetch_row(&syn1[vocab[central].point[d + 1] * layer1_size], layer1_size);
     label = vocab[central].code[d];
     label = label == 0 ? -1 : 1;
-    for (c = 0; c < layer1_size; c++) f += context_vector[c] * syn1[c + l2];
-    likelihood += -1.0 * log(1.0 + exp(label * f) );
+    f = dot(context_vector, &syn1[l2], layer1_size);
+    likelihood += m_doc2vec->logSigmoid(-label * f);
   }
   return likelihood;
 }
@@ -29,11 +29,24 @@ long long Vocabulary::searchVocab(const std::string & word) const
   else return -1;
 }
 
+void Vocabulary::searchWords(const std::vector<std::string> & words, std::vector<long long> & ids, long long skip) const
+{
+  for (size_t i = 0; i < words.size(); i++) {
+    if ((long long)i == skip) continue;
+    long long word_idx = searchVocab(words[i]);
+    if (word_idx == -1) continue;
+    if (word_idx == 0) break;
+    ids.push_back(word_idx);
+  }
+}
+
 void Vocabulary::loadFromTrainFile(Input & train_file) {
   TaggedBrownCorpus corpus(train_file);
   m_vocab.clear();
   m_vocab_hash.clear();
   if(!m_doctag) addWordToVocab("</s>", 0);
+  // last document each word was counted for, by vocab index
+  std::vector<size_t> last_doc(m_vocab.size(), 0);
   TaggedDocument * doc = NULL;
   while ((doc = corpus.next()) != NULL) {
     if(m_doctag) {  //for doc tag
@@ -45,6 +58,7 @@ void Vocabulary::loadFromTrainFile(Input & train_file) {
 	addWordToVocab(word);
       }
     } else { // for doc words
+      m_docs++;
       for(size_t k = 0; k < doc->m_words.size(); k++){
         auto & word = doc->m_words[k];
         m_train_words++;
@@ -54,8 +68,17 @@ void Vocabulary::loadFromTrainFile(Input & train_file) {
           fflush(stderr);
         }
         long long i = searchVocab(word);
-        if (i == -1) addWordToVocab(word);
-	else m_vocab[i].cn++;
+        if (i == -1) {
+          i = m_vocab.size();
+          addWordToVocab(word);
+          last_doc.push_back(0);
+        } else {
+          m_vocab[i].cn++;
+        }
+        if (last_doc[i] != m_docs) {
+          last_doc[i] = m_docs;
+          m_vocab[i].df++;
+        }
       }
       m_train_words--;
     }
@@ -68,6 +91,48 @@ void Vocabulary::loadFromTrainFile(Input & train_file) {
   }
 }
 
+void Vocabulary::addWord(const std::string & word, size_t cn)
+{
+  addWordToVocab(word, cn);
+  m_train_words += cn;
+}
+
+size_t Vocabulary::addDocTags(Input & train_file)
+{
+  TaggedBrownCorpus corpus(train_file);
+  TaggedDocument * doc = NULL;
+  size_t added = 0;
+  while ((doc = corpus.next()) != NULL) {
+    m_train_words++;
+    if (searchVocab(doc->m_tag) != -1) continue;
+    addWordToVocab(doc->m_tag);
+    added++;
+  }
+  return added;
+}
+
+void Vocabulary::countDocuments(Input & train_file, const Vocabulary & doc_tags, long long first_new)
+{
+  // models saved without document frequencies keep none
+  if (m_docs == 0) return;
+  TaggedBrownCorpus corpus(train_file);
+  std::vector<size_t> last_doc(m_vocab.size(), 0);
+  size_t line = 0;
+  TaggedDocument * doc = NULL;
+  while ((doc = corpus.next()) != NULL) {
+    line++;
+    bool new_doc = doc_tags.searchVocab(doc->m_tag) == -1;
+    if (new_doc) m_docs++;
+    for (auto & word : doc->m_words) {
+      long long i = searchVocab(word);
+      if (i == 0) break;
+      if (i < 0 || (!new_doc && i < first_new) || last_doc[i] == line) continue;
+      last_doc[i] = line;
+      m_vocab[i].df++;
+    }
+  }
+}
+
 void Vocabulary::addWordToVocab(const std::string & word, size_t initial_count) 
 {
   vocab_word_t w(word, initial_count);    
@@ -106,7 +171,7 @@ void Vocabulary::createHuffmanTree()
   long long b, i, min1i, min2i, point[MAX_CODE_LENGTH];
   char code[MAX_CODE_LENGTH];
   std::unique_ptr<long long[]> count(new long long[m_vocab.size() * 2 + 1]);
-  std::unique_ptr<long long[]> binary(new long long[m_vocab.size() * 2 + 1]);
+  std::unique_ptr<long long[]> binary(new long long[m_vocab.size() * 2 + 1]());
   std::unique_ptr<long long[]> parent_node(new long long[m_vocab.size() * 2 + 1]);
   for (size_t a = 0; a < m_vocab.size(); a++) {
     m_vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
@@ -170,11 +235,12 @@ void Vocabulary::createHuffmanTree()
 
 void Vocabulary::save(FILE * fout) const
 {
-  long long dummy = 0, size = m_vocab.size();
+  long long size = m_vocab.size();
   
   fwrite(&size, sizeof(long long), 1, fout);
   fwrite(&m_train_words, sizeof(long long), 1, fout);
-  fwrite(&dummy, sizeof(long long), 1, fout);
+  // formerly unused, files with a document count carry df after cn
+  fwrite(&m_docs, sizeof(long long), 1, fout);
   fwrite(&m_min_count, sizeof(int), 1, fout);
   fwrite(&m_doctag, sizeof(bool), 1, fout);
   for (auto & w : m_vocab) {
@@ -182,6 +248,7 @@ void Vocabulary::save(FILE * fout) const
     fwrite(&wordlen, sizeof(unsigned int), 1, fout);
     fwrite(w.word.data(), sizeof(char), wordlen, fout);
     fwrite(&(w.cn), sizeof(size_t), 1, fout);
+    if (m_docs > 0) fwrite(&(w.df), sizeof(size_t), 1, fout);
     if(!m_doctag)
     {
       fwrite(&(w.codelen), sizeof(char), 1, fout);
@@ -193,10 +260,10 @@ void Vocabulary::save(FILE * fout) const
 
 void Vocabulary::load(FILE * fin)
 {
-  size_t size, dummy;
+  size_t size;
   fread(&size, sizeof(size_t), 1, fin);
   fread(&m_train_words, sizeof(size_t), 1, fin);
-  fread(&dummy, sizeof(size_t), 1, fin);
+  fread(&m_docs, sizeof(size_t), 1, fin);
   fread(&m_min_count, sizeof(int), 1, fin);
   fread(&m_doctag, sizeof(bool), 1, fin);
 
@@ -215,6 +282,7 @@ void Vocabulary::load(FILE * fin)
     fread(&cn, sizeof(size_t), 1, fin);
     
     vocab_word_t w(tmp, cn);
+    if (m_docs > 0) fread(&(w.df), sizeof(size_t), 1, fin);
 
     if (!m_doctag) {
       fread(&(w.codelen), sizeof(char), 1, fin);
@@ -8,33 +8,38 @@ using namespace doc2vec;
 
 WMD::WMD(Model * doc2vec) : m_doc2vec(doc2vec)
 {
-  m_corpus = new UnWeightedDocument*[m_doc2vec->nn().m_corpus_size];
-  for(size_t a = 0; a < m_doc2vec->nn().m_corpus_size; a++) m_corpus[a] = NULL;  
+  m_corpus.assign(m_doc2vec->nn().m_corpus_size, NULL);
   m_doc2vec_knns = new knn_item_t[MAX_DOC2VEC_KNN];
 }
 
 WMD::~WMD()
 {
-  if (m_corpus) {
-    for(size_t a = 0; a < m_doc2vec->nn().m_corpus_size; a++) if(m_corpus[a]) delete m_corpus[a];
-    delete [] m_corpus;
-  }
+  for (auto doc : m_corpus) if (doc) delete doc;
   if(m_doc2vec_knns) delete [] m_doc2vec_knns;
 }
 
 void WMD::train()
 {
-  loadFromDoc2Vec();
+  loadFromDoc2Vec(m_doc2vec->brownCorpus(), 0);
+}
+
+void WMD::add(Input & input, long long first_doc)
+{
+  m_corpus.resize(m_doc2vec->nn().m_corpus_size, NULL);
+  TaggedBrownCorpus corpus(input);
+  loadFromDoc2Vec(corpus, first_doc);
 }
 
 void WMD::save(FILE * fout) const
 {
-  for(size_t a = 0; a < m_doc2vec->nn().m_corpus_size; a++) m_corpus[a]->save(fout);
+  UnWeightedDocument empty;
+  for(size_t a = 0; a < m_doc2vec->nn().m_corpus_size; a++) (m_corpus[a] ? m_corpus[a] : &empty)->save(fout);
 }
 
 void WMD::load(FILE * fin)
 {
-  m_corpus = new UnWeightedDocument*[m_doc2vec->nn().m_corpus_size];
+  for (auto doc : m_corpus) if (doc) delete doc;
+  m_corpus.assign(m_doc2vec->nn().m_corpus_size, NULL);
   for(size_t a = 0; a < m_doc2vec->nn().m_corpus_size; a++)
   {
     m_corpus[a] = new UnWeightedDocument();
@@ -46,85 +51,107 @@ void WMD::load(FILE * fin)
   }
 }
 
-void WMD::loadFromDoc2Vec()
+void WMD::loadFromDoc2Vec(TaggedBrownCorpus & corpus, long long first_doc)
 {
+  // documents are read serially and converted in parallel batches
+  const size_t batch_size = 10000;
+  auto & pool = m_doc2vec->threadPool();
+  std::vector<TaggedDocument> batch;
+  std::vector<long long> batch_idx;
+  std::vector<UnWeightedDocument *> converted(batch_size);
+  auto flush = [&]() {
+    pool.parallel_for(batch.size(), 64, [&](size_t begin, size_t end, size_t) {
+      for (size_t a = begin; a < end; a++) converted[a] = new UnWeightedDocument(m_doc2vec, &batch[a]);
+    });
+    // in corpus order, a repeated tag keeps its last document
+    for (size_t a = 0; a < batch.size(); a++) {
+      if (m_corpus[batch_idx[a]]) delete m_corpus[batch_idx[a]];
+      m_corpus[batch_idx[a]] = converted[a];
+    }
+    batch.clear();
+    batch_idx.clear();
+  };
   long long doc_idx;
   TaggedDocument * doc = NULL;
-  m_doc2vec->brownCorpus().rewind();
-  while((doc = m_doc2vec->brownCorpus().next()) != NULL)
+  corpus.rewind();
+  while((doc = corpus.next()) != NULL)
   {
     doc_idx = m_doc2vec->dvocab().searchVocab(doc->m_tag);
-    if(doc_idx == -1) continue;
-    m_corpus[doc_idx] = new UnWeightedDocument(m_doc2vec, doc);
+    if(doc_idx < first_doc) continue;
+    batch.push_back(*doc);
+    batch_idx.push_back(doc_idx);
+    if (batch.size() == batch_size) flush();
   }
+  flush();
 }
 
-void WMD::sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k)
+void WMD::knn_targets(WeightedDocument & src, size_t n, const std::function<long long(size_t)> & idx,
+  knn_item_t * knns, size_t k)
 {
-  UnWeightedDocument * target;
-  WeightedDocument src(m_doc2vec, &doc);
-  top_init(knns, k);
-  for (size_t b = 1, c = 0; b < m_doc2vec->nn().m_corpus_size; b++)
-  {
-    target = m_corpus[b];
-    if (target) {
-      if (c < k) {
-        knns[c].similarity = -rwmd(&src, target);
-        knns[c].idx = b;
-        c++;
-        if (c == k) top_init(knns, k);
-      }
-      else top_collect(knns, k, b, -rwmd(&src, target));
+  // every worker keeps its own top k, merged afterwards
+  auto & pool = m_doc2vec->threadPool();
+  std::vector<std::vector<knn_item_t>> parts(pool.size(), std::vector<knn_item_t>(k));
+  std::vector<size_t> counts(pool.size(), 0);
+  pool.parallel_for(n, 16, [&](size_t begin, size_t end, size_t worker) {
+    real * dis = pool.scratch(src.m_words_idx.size());
+    for (size_t b = begin; b < end; b++)
+    {
+      long long target_idx = idx(b);
+      UnWeightedDocument * target = m_corpus[target_idx];
+      if (target) top_add(parts[worker].data(), k, counts[worker], target_idx, -rwmd(&src, target, dis));
     }
+  });
+  size_t c = 0;
+  for (size_t w = 0; w < parts.size(); w++) {
+    for (size_t b = 0; b < counts[w]; b++) top_add(knns, k, c, parts[w][b].idx, parts[w][b].similarity);
   }
-  top_sort(knns, k);
+  if (c < k) top_init(knns, c);
+  top_sort(knns, c);
   auto & vocab = m_doc2vec->dvocab().getWords();
-  for (size_t b = 0; b < k; b++) knns[b].word = vocab[knns[b].idx].word;
+  for (size_t b = 0; b < c; b++) knns[b].word = vocab[knns[b].idx].word;
 }
 
-void WMD::sent_knn_docs_ex(TaggedDocument & doc, knn_item_t * knns, size_t k)
+bool WMD::sent_knn_docs(TaggedDocument & doc, knn_item_t * knns, size_t k)
 {
-  m_doc2vec->sent_knn_docs(doc, m_doc2vec_knns, MAX_DOC2VEC_KNN);
-  
-  UnWeightedDocument * target;
+  if (!m_doc2vec->checkWordVectors("WMD")) return false;
   WeightedDocument src(m_doc2vec, &doc);
-  top_init(knns, k);
-  for (size_t b = 0, c = 0; b < MAX_DOC2VEC_KNN; b++)
-  {
-    long long idx = m_doc2vec_knns[b].idx;
-    target = m_corpus[idx];
-    if (target) {
-      if(c < k) {
-        knns[c].similarity = -rwmd(&src, target);
-        knns[c].idx = idx;
-        c++;
-        if (c == k) top_init(knns, k);
-      }
-      else top_collect(knns, k, idx, -rwmd(&src, target));
-    }
-  }
-  top_sort(knns, k);
-  auto & vocab = m_doc2vec->dvocab().getWords();
-  for (size_t b = 0; b < k; b++) knns[b].word = vocab[knns[b].idx].word;
+  knn_targets(src, m_doc2vec->nn().m_corpus_size - 1, [](size_t b) { return (long long)b + 1; }, knns, k);
+  return true;
+}
+
+bool WMD::sent_knn_docs_ex(TaggedDocument & doc, knn_item_t * knns, size_t k)
+{
+  if (!m_doc2vec->checkWordVectors("WMD")) return false;
+  // an HNSW or IVF index may return fewer candidates than asked for
+  size_t n = m_doc2vec->sent_knn_docs(doc, m_doc2vec_knns, MAX_DOC2VEC_KNN);
+
+  WeightedDocument src(m_doc2vec, &doc);
+  knn_targets(src, n, [this](size_t b) { return m_doc2vec_knns[b].idx; }, knns, k);
+  return true;
 }
 
 real WMD::rwmd(WeightedDocument * src, UnWeightedDocument * target)
+{
+  std::unique_ptr<real[]> dis(new real[src->m_words_idx.size()]);
+  return rwmd(src, target, dis.get());
+}
+
+real WMD::rwmd(WeightedDocument * src, UnWeightedDocument * target, real * dis)
 {
   if (src->m_words_idx.empty() || target->m_words_idx.empty()) return (std::numeric_limits<double>::max)();
   auto syn0norm = m_doc2vec->nn().get_syn0norm();
   long long dim = m_doc2vec->nn().dim();
 
-  std::unique_ptr<real[]> m_dis_vector(new real[src->m_words_idx.size()]);
-  std::fill(m_dis_vector.get(), m_dis_vector.get() + src->m_words_idx.size(), (std::numeric_limits<double>::max)());
-  
+  std::fill(dis, dis + src->m_words_idx.size(), (std::numeric_limits<double>::max)());
+
   for (size_t a = 0; a < src->m_words_idx.size(); a++) {
     for (size_t b = 0; b < target->m_words_idx.size(); b++) {
       real score = m_doc2vec->distance(&(syn0norm[src->m_words_idx[a] * dim]), &(syn0norm[target->m_words_idx[b] * dim]));
-      m_dis_vector[a] = MIN(m_dis_vector[a], score);
+      dis[a] = MIN(dis[a], score);
     }
   }
   real l1 = 0;
-  for(size_t a = 0; a < src->m_words_idx.size(); a++) l1 += m_dis_vector[a] * src->m_words_wei[a];
-  
+  for(size_t a = 0; a < src->m_words_idx.size(); a++) l1 += dis[a] * src->m_words_wei[a];
+
   return l1;
 }
@@ -7,13 +7,15 @@
 using namespace doc2vec;
 
 // setup parameters
-std::string train_file, output_file;
+std::string train_file, output_file, init_model_file, checkpoint_file, resume_file;
 bool cbow = true;
-int window = 5, min_count = 1, num_threads = 4;
-bool hs = 1;
+int window = 5, min_count = 1, num_threads = 4, num_processes = 1, checkpoint_epochs = 1;
+bool hs = 1, dbow_words = true, freeze_words = false;
 int negative = 0;
 long long dim = 100, iter = 50;
-real alpha = 0.025, sample = 1e-3;
+real alpha = 0.025, sample = 1e-3, holdout = 0;
+int patience = 1;
+int hnsw = 0, ivf = -1, pq = 0, int8 = 0, binary = 0, pca = 0;
 
 static int ArgPos(char *str, int argc, char **argv);
 static void usage();
@@ -44,6 +46,32 @@ void usage()
   fprintf(stderr, "\t\tUse text data from <file> to train the model\n");
   fprintf(stderr, "\t-output <file>\n");
   fprintf(stderr, "\t\tUse <file> to save the resulting model\n");
+  fprintf(stderr, "\t-init-model <file>\n");
+  fprintf(stderr, "\t\tStart from the vocabulary and word vectors of the model in <file>; model options and early stopping are taken from it\n");
+  fprintf(stderr, "\t-freeze-words <int>\n");
+  fprintf(stderr, "\t\tKeep word vectors of -init-model fixed and only train document vectors; default is 0\n");
+  fprintf(stderr, "\t-checkpoint <file>\n");
+  fprintf(stderr, "\t\tPeriodically save the training state to <file>\n");
+  fprintf(stderr, "\t-checkpoint-epochs <int>\n");
+  fprintf(stderr, "\t\tSave a checkpoint every <int> epochs; default is 1\n");
+  fprintf(stderr, "\t-resume <file>\n");
+  fprintf(stderr, "\t\tContinue training on the -train data from the checkpoint in <file>; model options are taken from it\n");
+  fprintf(stderr, "\t-holdout <float>\n");
+  fprintf(stderr, "\t\tScore this fraction of the documents after every epoch and stop early once it converged(needs -hs 1 and trained word vectors); default is 0\n");
+  fprintf(stderr, "\t-patience <int>\n");
+  fprintf(stderr, "\t\tStop after <int> epochs without held-out improvement; default is 1\n");
+  fprintf(stderr, "\t-hnsw <int>\n");
+  fprintf(stderr, "\t\tBuild HNSW indexes with <int> links per node and save them to <file>.hnsw of -output; default is 0 (none)\n");
+  fprintf(stderr, "\t-ivf <int>\n");
+  fprintf(stderr, "\t\tBuild an IVF index of the document vectors with <int> lists (0 = square root of the corpus size) and save it to <file>.ivf of -output; default is none\n");
+  fprintf(stderr, "\t-int8 <int>\n");
+  fprintf(stderr, "\t\tSave int8 copies of the normalized vectors with the model for faster kNN scans; default is 0 (off)\n");
+  fprintf(stderr, "\t-pca <int>\n");
+  fprintf(stderr, "\t\tSave PCA rotated copies of the normalized vectors with the model for pruned exact kNN scans; default is 0 (off)\n");
+  fprintf(stderr, "\t-pq <int>\n");
+  fprintf(stderr, "\t\tQuantize the document vectors to <int> byte codes and save them to <file>.pq of -output, which Model::load can serve from instead of the vectors; default is 0 (none)\n");
+  fprintf(stderr, "\t-binary <int>\n");
+  fprintf(stderr, "\t\tSave sign-bit signatures of the word and document vectors to <file>.bits of -output, 2 after a random rotation; default is 0 (none)\n");
   fprintf(stderr, "\t-dim <int>\n");
   fprintf(stderr, "\t\tSet dimention of document/word vectors; default is 100\n");
   fprintf(stderr, "\t-window <int>\n");
@@ -53,6 +81,8 @@ void usage()
   fprintf(stderr, "\t\twill be randomly down-sampled; default is 1e-3, useful range is (0, 1e-5)\n");
   fprintf(stderr, "\t-threads <int>\n");
   fprintf(stderr, "\t\tUse <int> threads (default 12)\n");
+  fprintf(stderr, "\t-processes <int>\n");
+  fprintf(stderr, "\t\tSplit the corpus over <int> training processes which average word vectors after every epoch; default is 1\n");
   fprintf(stderr, "\t-iter <int>\n");
   fprintf(stderr, "\t\tRun more training iterations (default 5)\n");
   fprintf(stderr, "\t-min-count <int>\n");
@@ -61,6 +91,8 @@ void usage()
   fprintf(stderr, "\t\tSet the starting learning rate; default is 0.025 for skip-gram and 0.05 for CBOW\n");
   fprintf(stderr, "\t-cbow <int>\n");
   fprintf(stderr, "\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
+  fprintf(stderr, "\t-dbow-words <int>\n");
+  fprintf(stderr, "\t\tTrain word vectors along with skip-gram document vectors; default is 1 (use 0 for pure PV-DBOW, whose model can't answer word queries)\n");
   fprintf(stderr, "\t-hs <int>\n");
   fprintf(stderr, "\t\tUse Hierarchical Softmax; default is 0 (not used)\n");
   fprintf(stderr, "\t-negative <int>\n");
@@ -74,6 +106,7 @@ int get_optarg(int argc, char **argv)
   if ((i = ArgPos((char *)"-dim", argc, argv)) > 0) dim = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) train_file = argv[i + 1];
   if ((i = ArgPos((char *)"-cbow", argc, argv)) > 0) cbow = atoi(argv[i + 1]) ? true : false;
+  if ((i = ArgPos((char *)"-dbow-words", argc, argv)) > 0) dbow_words = atoi(argv[i + 1]) ? true : false;
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
   if (cbow) alpha = 0.05;
@@ -82,8 +115,22 @@ int get_optarg(int argc, char **argv)
   if ((i = ArgPos((char *)"-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-processes", argc, argv)) > 0) num_processes = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-model", argc, argv)) > 0) init_model_file = argv[i + 1];
+  if ((i = ArgPos((char *)"-freeze-words", argc, argv)) > 0) freeze_words = atoi(argv[i + 1]) ? true : false;
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) checkpoint_file = argv[i + 1];
+  if ((i = ArgPos((char *)"-checkpoint-epochs", argc, argv)) > 0) checkpoint_epochs = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-resume", argc, argv)) > 0) resume_file = argv[i + 1];
+  if ((i = ArgPos((char *)"-holdout", argc, argv)) > 0) holdout = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-patience", argc, argv)) > 0) patience = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hnsw", argc, argv)) > 0) hnsw = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-ivf", argc, argv)) > 0) ivf = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-int8", argc, argv)) > 0) int8 = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-pca", argc, argv)) > 0) pca = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-pq", argc, argv)) > 0) pq = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
   return output_file.empty() ? -1 : 0;
 }
 
@@ -103,9 +150,82 @@ int main(int argc, char **argv)
   FileInput input(train_file);
   
   Model doc2vec;
-  doc2vec.train(input, dim, cbow, hs, negative, iter, window, alpha, sample, min_count, num_threads);
+  doc2vec.setProcesses(num_processes);
+  doc2vec.setEarlyStopping(holdout, patience);
+  if (!checkpoint_file.empty()) doc2vec.setCheckpoint(checkpoint_file, checkpoint_epochs);
+  if (!resume_file.empty()) {
+    FILE * fin = fopen(resume_file.c_str(), "rb");
+    if (!fin) {
+      fprintf(stderr, "Unable to open file %s\n", resume_file.c_str());
+      return 1;
+    }
+    doc2vec.resume(input, fin);
+    fclose(fin);
+  } else if (!init_model_file.empty()) {
+    FILE * fin = fopen(init_model_file.c_str(), "rb");
+    if (!fin) {
+      fprintf(stderr, "Unable to open file %s\n", init_model_file.c_str());
+      return 1;
+    }
+    Model base;
+    base.load(fin);
+    fclose(fin);
+    doc2vec.train(input, base, freeze_words, iter, alpha, num_threads);
+  } else {
+    doc2vec.train(input, dim, cbow, hs, negative, iter, window, alpha, sample, min_count, num_threads, dbow_words);
+  }
+  if (int8) doc2vec.setInt8(true);
+  if (pca) doc2vec.buildPca();
   fprintf(stderr, "\nWrite model to %s\n", output_file.c_str());
   doc2vec.save(fout);
   fclose(fout);
+  if (hnsw > 0) {
+    doc2vec.buildHnsw(hnsw);
+    std::string index_file = output_file + ".hnsw";
+    fprintf(stderr, "Write HNSW indexes to %s\n", index_file.c_str());
+    FILE * findex = fopen(index_file.c_str(), "wb");
+    if (!findex) {
+      fprintf(stderr, "Unable to open file %s\n", index_file.c_str());
+      return 1;
+    }
+    doc2vec.saveHnsw(findex);
+    fclose(findex);
+  }
+  if (ivf >= 0) {
+    doc2vec.buildIvf(ivf);
+    std::string index_file = output_file + ".ivf";
+    fprintf(stderr, "Write IVF index to %s\n", index_file.c_str());
+    FILE * findex = fopen(index_file.c_str(), "wb");
+    if (!findex) {
+      fprintf(stderr, "Unable to open file %s\n", index_file.c_str());
+      return 1;
+    }
+    doc2vec.saveIvf(findex);
+    fclose(findex);
+  }
+  if (pq > 0) {
+    doc2vec.buildPq(pq);
+    std::string index_file = output_file + ".pq";
+    fprintf(stderr, "Write PQ codes to %s\n", index_file.c_str());
+    FILE * findex = fopen(index_file.c_str(), "wb");
+    if (!findex) {
+      fprintf(stderr, "Unable to open file %s\n", index_file.c_str());
+      return 1;
+    }
+    doc2vec.savePq(findex);
+    fclose(findex);
+  }
+  if (binary > 0) {
+    doc2vec.buildBinary(binary > 1);
+    std::string index_file = output_file + ".bits";
+    fprintf(stderr, "Write binary signatures to %s\n", index_file.c_str());
+    FILE * findex = fopen(index_file.c_str(), "wb");
+    if (!findex) {
+      fprintf(stderr, "Unable to open file %s\n", index_file.c_str());
+      return 1;
+    }
+    doc2vec.saveBinary(findex);
+    fclose(findex);
+  }
   return 0;
 }
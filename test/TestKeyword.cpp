@@ -1,5 +1,5 @@
 #include <limits>
-#include <stdarg.h>
+#include <algorithm>
 #include "gtest/gtest.h"
 #include <Model.h>
 #include <TaggedBrownCorpus.h>
@@ -9,8 +9,7 @@
 
 using namespace doc2vec;
 
-static int compare(const void *a,const void *b);
-static void buildDoc(TaggedDocument * doc, ...);
+static void sortKeywords(std::vector<knn_item_t> & knn_items);
 
 class TestKeyword: public ::testing::Test{
 protected:
@@ -24,174 +23,94 @@ protected:
   virtual void TearDown() {}
 
 public:
-  //leave one out
-  static void getLOOKeyords(TaggedDocument * doc, knn_item_t * knn_items)
-  {
-    real * infer_vector1 = NULL;
-    posix_memalign((void **)&infer_vector1, 128, doc2vec.dim() * sizeof(real));
-    real * infer_vector2 = NULL;
-    posix_memalign((void **)&infer_vector2, 128, doc2vec.dim() * sizeof(real));
-    doc2vec.infer_doc(*doc, infer_vector1);
-
-    for(int i = 0; i < doc->m_word_num - 1; i++) {
-      doc2vec.infer_doc(*doc, infer_vector2, i);
-      strcpy(knn_items[i].word, doc->m_words[i]);
-      knn_items[i].similarity = doc2vec.similarity(infer_vector1, infer_vector2);
-    }
-    qsort((void *)knn_items, doc->m_word_num - 1, sizeof(knn_item_t), compare);
-    free(infer_vector1);
-    free(infer_vector2);
-  }
-
   //similar
-  static void getSimKeywords(TaggedDocument * doc, knn_item_t * knn_items)
+  static void getSimKeywords(TaggedDocument & doc, std::vector<knn_item_t> & knn_items)
   {
-    long long word_idx;
-    real * infer_vector = NULL, *wv = NULL;
-    posix_memalign((void **)&infer_vector, 128, doc2vec.dim() * sizeof(real));
-    doc2vec.infer_doc(*doc, infer_vector);
-    for(int i = 0; i < doc->m_word_num - 1; i++) {
-      strcpy(knn_items[i].word, doc->m_words[i]);
-      word_idx = doc2vec.wvocab()->searchVocab(doc->m_words[i]);
+    std::vector<real> infer_vector(doc2vec.dim());
+    doc2vec.infer_doc(doc, infer_vector.data());
+    knn_items.assign(doc.m_words.size() - 1, knn_item_t());
+    for(size_t i = 0; i < knn_items.size(); i++) {
+      knn_items[i].word = doc.m_words[i];
+      long long word_idx = doc2vec.wvocab().searchVocab(doc.m_words[i]);
       if(word_idx <= 0) continue;
-      wv = &(doc2vec.nn()->m_syn0norm[word_idx * doc2vec.dim()]);
-      knn_items[i].similarity = doc2vec.similarity(infer_vector, wv);
+      const real * wv = &(doc2vec.nn().get_syn0norm()[word_idx * doc2vec.dim()]);
+      knn_items[i].similarity = doc2vec.similarity(infer_vector.data(), wv);
     }
-    qsort((void *)knn_items, doc->m_word_num - 1, sizeof(knn_item_t), compare);
-    free(infer_vector);
+    sortKeywords(knn_items);
   }
 
   //likelihood
-  static void getLKHKeyords(TaggedDocument * doc, knn_item_t * knn_items)
+  static void getLKHKeyords(TaggedDocument & doc, std::vector<knn_item_t> & knn_items)
   {
-    TaggedDocument doc1;
-    for(int i = 0; i < doc->m_word_num - 1; i++) {
-      strcpy(knn_items[i].word, doc->m_words[i]);
-      knn_items[i].similarity = doc2vec.doc_likelihood(*doc, i);
+    knn_items.assign(doc.m_words.size() - 1, knn_item_t());
+    for(size_t i = 0; i < knn_items.size(); i++) {
+      knn_items[i].word = doc.m_words[i];
+      knn_items[i].similarity = doc2vec.doc_likelihood(doc, i);
     }
-    qsort((void *)knn_items, doc->m_word_num - 1, sizeof(knn_item_t), compare);
+    sortKeywords(knn_items);
   }
 
-  static void print_keywords(const char* word, knn_item_t * knn_items, int n)
+  static void print_keywords(const char* word, const std::vector<knn_item_t> & knn_items)
   {
     printf("================ %s ===================\n", word);
-    for(int a = 0; a < n; a++)
+    for(auto & knn : knn_items)
     {
-      printf("%s -> %.2f\n", knn_items[a].word, knn_items[a].similarity);
+      printf("%s -> %.2f\n", knn.word.c_str(), knn.similarity);
     }
   }
 
 public:
-  static Doc2Vec doc2vec;
+  static Model doc2vec;
 };
-Doc2Vec TestKeyword::doc2vec;
-
-int compare(const void *a,const void *b)
-{
-  knn_item_t * aa = (knn_item_t*)a;
-  knn_item_t * bb = (knn_item_t*)b;
-  if(bb->similarity - aa->similarity > 0)
-    return -1;
-  else if(bb->similarity - aa->similarity < 0)
-    return 1;
-  else
-    return 0;
-}
+Model TestKeyword::doc2vec;
 
-void buildDoc(TaggedDocument * doc, ...)
+void sortKeywords(std::vector<knn_item_t> & knn_items)
 {
-  va_list pArg;
-  va_start(pArg, doc);
-  for(int i = 0; i < doc->m_word_num; i++){
-    strcpy(doc->m_words[i], va_arg(pArg, char*));
-  }
-  va_end(pArg);
+  std::sort(knn_items.begin(), knn_items.end(), [](const knn_item_t & a, const knn_item_t & b) {
+    return a.similarity < b.similarity;
+  });
 }
 
 TEST_F(TestKeyword, LOO) {
-  TaggedDocument doc;
-  knn_item_t * knn_items = NULL;
-
-  doc.m_word_num = 6;
-  buildDoc(&doc, "反求工程", "cad", "建模", "技术", "研究", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLOOKeyords(&doc, knn_items);
-  print_keywords("反求工程CAD建模技术研究", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-  doc.m_word_num = 5;
-  buildDoc(&doc, "遥感信息", "发展战略", "与", "对策", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLOOKeyords(&doc, knn_items);
-  print_keywords("遥感信息发展战略与对策", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-  doc.m_word_num = 7;
-  buildDoc(&doc, "遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLOOKeyords(&doc, knn_items);
-  print_keywords("遥感信息水文动态模拟中应用", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-  doc.m_word_num = 11;
-  buildDoc(&doc, "光伏", "并网发电", "系统", "中",	"逆变器", "的", "设计",	"与", "控制", "方法", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLOOKeyords(&doc, knn_items);
-  print_keywords("光伏并网发电系统中逆变器的设计与控制方法", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
+  TaggedDocument docs[4] = {
+    TaggedDocument({"反求工程", "cad", "建模", "技术", "研究", "</s>"}),
+    TaggedDocument({"遥感信息", "发展战略", "与", "对策", "</s>"}),
+    TaggedDocument({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"}),
+    TaggedDocument({"光伏", "并网发电", "系统", "中", "逆变器", "的", "设计", "与", "控制", "方法", "</s>"})
+  };
+  for (auto & doc : docs) {
+    std::vector<knn_item_t> knns = doc2vec.keywords(doc);
+    printf("================ %s ===================\n", doc.m_words[0].c_str());
+    for (auto & knn : knns) printf("%s -> %.2f\n", knn.word.c_str(), knn.similarity);
+    // one item per distinct known word, most important first
+    EXPECT_LE(knns.size(), doc.m_words.size() - 1);
+    for (size_t a = 1; a < knns.size(); a++) EXPECT_GE(knns[a - 1].similarity, knns[a].similarity);
+  }
 }
 
 TEST_F(TestKeyword, LKH) {
-  TaggedDocument doc;
-  knn_item_t * knn_items = NULL;
-
-  doc.m_word_num = 5;
-  buildDoc(&doc, "遥感信息", "发展战略", "与", "对策", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLKHKeyords(&doc, knn_items);
-  print_keywords("遥感信息发展战略与对策", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-  doc.m_word_num = 7;
-  buildDoc(&doc, "遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLKHKeyords(&doc, knn_items);
-  print_keywords("遥感信息水文动态模拟中应用", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-
-  doc.m_word_num = 11;
-  buildDoc(&doc, "光伏", "并网发电", "系统", "中",	"逆变器", "的", "设计",	"与", "控制", "方法", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getLKHKeyords(&doc, knn_items);
-  print_keywords("光伏并网发电系统中逆变器的设计与控制方法", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
+  TaggedDocument docs[3] = {
+    TaggedDocument({"遥感信息", "发展战略", "与", "对策", "</s>"}),
+    TaggedDocument({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"}),
+    TaggedDocument({"光伏", "并网发电", "系统", "中", "逆变器", "的", "设计", "与", "控制", "方法", "</s>"})
+  };
+  std::vector<knn_item_t> knn_items;
+  for (auto & doc : docs) {
+    getLKHKeyords(doc, knn_items);
+    print_keywords(doc.m_words[0].c_str(), knn_items);
+  }
 }
 
 
 TEST_F(TestKeyword, SIM) {
-  TaggedDocument doc;
-  knn_item_t * knn_items = NULL;
-
-  doc.m_word_num = 5;
-  buildDoc(&doc, "遥感信息", "发展战略", "与", "对策", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getSimKeywords(&doc, knn_items);
-  print_keywords("遥感信息发展战略与对策", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-  doc.m_word_num = 7;
-  buildDoc(&doc, "遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getSimKeywords(&doc, knn_items);
-  print_keywords("遥感信息水文动态模拟中应用", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
-
-
-  doc.m_word_num = 11;
-  buildDoc(&doc, "光伏", "并网发电", "系统", "中",	"逆变器", "的", "设计",	"与", "控制", "方法", "</s>");
-  knn_items = new knn_item_t[doc.m_word_num - 1];
-  getSimKeywords(&doc, knn_items);
-  print_keywords("光伏并网发电系统中逆变器的设计与控制方法", knn_items, doc.m_word_num - 1);
-  delete [] knn_items;
+  TaggedDocument docs[3] = {
+    TaggedDocument({"遥感信息", "发展战略", "与", "对策", "</s>"}),
+    TaggedDocument({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"}),
+    TaggedDocument({"光伏", "并网发电", "系统", "中", "逆变器", "的", "设计", "与", "控制", "方法", "</s>"})
+  };
+  std::vector<knn_item_t> knn_items;
+  for (auto & doc : docs) {
+    getSimKeywords(doc, knn_items);
+    print_keywords(doc.m_words[0].c_str(), knn_items);
+  }
 }
@@ -1,8 +1,10 @@
 #include <limits>
+#include <algorithm>
 #include <stdarg.h>
 #include "gtest/gtest.h"
 #include <Model.h>
 #include <WMD.h>
+#include <InferenceSession.h>
 #include <TaggedBrownCorpus.h>
 #include <common_define.h>
 
@@ -100,6 +102,377 @@ TEST_F(TestSimilar, wmd) {
   print_knns("反求工程CAD建模技术研究");
 }
 
+TEST_F(TestSimilar, wmd_ivf) {
+  // one probed list holds fewer documents than the WMD candidates asked for
+  doc2vec.buildIvf();
+  doc2vec.setIvfProbes(1);
+  TaggedDocument query({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"});
+  std::vector<knn_item_t> candidates(MAX_DOC2VEC_KNN);
+  size_t n = doc2vec.sent_knn_docs(query, candidates.data(), MAX_DOC2VEC_KNN);
+  EXPECT_GT(n, 0u);
+  for (size_t b = 0; b < MAX_DOC2VEC_KNN; b++) EXPECT_EQ(b < n, candidates[b].idx >= 0);
+  doc2vec.wmd().sent_knn_docs_ex(query, knn_items, K);
+  for (size_t b = 0; b < std::min(n, (size_t)K); b++) {
+    EXPECT_GE(knn_items[b].idx, 0);
+    EXPECT_LT(knn_items[b].idx, doc2vec.dvocab().size());
+  }
+  print_knns("遥感信息水文动态模拟中应用");
+  doc2vec.setIvfProbes(8);
+  doc2vec.dropIvf();
+}
+
+TEST_F(TestSimilar, wmd_hnsw) {
+  // a narrow beam over a graph may find fewer documents than the WMD candidates asked for
+  doc2vec.buildHnsw(4, 16);
+  doc2vec.setHnswEf(16);
+  TaggedDocument query({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"});
+  std::vector<knn_item_t> candidates(MAX_DOC2VEC_KNN);
+  size_t n = doc2vec.sent_knn_docs(query, candidates.data(), MAX_DOC2VEC_KNN);
+  EXPECT_GT(n, 0u);
+  for (size_t b = 0; b < MAX_DOC2VEC_KNN; b++) EXPECT_EQ(b < n, candidates[b].idx >= 0);
+  doc2vec.wmd().sent_knn_docs_ex(query, knn_items, K);
+  for (size_t b = 0; b < std::min(n, (size_t)K); b++) {
+    EXPECT_GE(knn_items[b].idx, 0);
+    EXPECT_LT(knn_items[b].idx, doc2vec.dvocab().size());
+  }
+  print_knns("遥感信息水文动态模拟中应用");
+  doc2vec.setHnswEf(64);
+  doc2vec.dropHnsw();
+}
+
+TEST_F(TestSimilar, infer_docs) {
+  TaggedDocument docs[2] = {
+    TaggedDocument({"遥感信息", "发展战略", "与", "对策", "</s>"}),
+    TaggedDocument({"新生儿", "败血症", "诊疗", "方案", "</s>"})
+  };
+  std::vector<real> batch(2 * doc2vec.dim()), single(doc2vec.dim());
+  doc2vec.infer_docs(docs, 2, batch.data());
+  for (int a = 0; a < 2; a++) {
+    doc2vec.infer_doc(docs[a], single.data());
+    EXPECT_EQ(0, memcmp(single.data(), &batch[a * doc2vec.dim()], doc2vec.dim() * sizeof(real)));
+  }
+}
+
+TEST_F(TestSimilar, inference_session) {
+  TaggedDocument doc({"反求工程", "cad", "建模", "技术", "研究", "</s>"});
+  InferenceSession session(doc2vec);
+  std::vector<long long> ids;
+  session.resolve(doc, ids);
+  // known words only, so word positions and id positions agree
+  doc.clear();
+  for (auto id : ids) doc.addWord(doc2vec.wvocab().getWords()[id].word);
+  std::vector<real> expected(doc2vec.dim()), vec(doc2vec.dim());
+  for (int skip = -1; skip < (int)ids.size(); skip++) {
+    doc2vec.infer_doc(doc, expected.data(), skip);
+    session.infer(ids.data(), ids.size(), vec.data(), skip);
+    EXPECT_EQ(0, memcmp(expected.data(), vec.data(), doc2vec.dim() * sizeof(real)));
+  }
+}
+
+TEST_F(TestSimilar, inference_convergence) {
+  TaggedDocument doc({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"});
+  InferenceSession session(doc2vec);
+  std::vector<real> full(doc2vec.dim()), vec(doc2vec.dim());
+  session.infer(doc, full.data());
+  EXPECT_EQ((int)doc2vec.iter(), session.passes());
+  session.setConvergence(0.05, 2);
+  session.infer(doc, vec.data());
+  EXPECT_LE(2, session.passes());
+  EXPECT_GE((int)doc2vec.iter(), session.passes());
+  EXPECT_GT(doc2vec.similarity(full.data(), vec.data()), 0.9);
+}
+
+TEST_F(TestSimilar, sif_to_doc) {
+  TaggedDocument doc({"遥感信息", "发展战略", "与", "对策", "</s>"});
+  std::vector<real> vec(doc2vec.dim()), ids_vec(doc2vec.dim());
+  doc2vec.sif_doc(doc, vec.data());
+  EXPECT_NEAR(1.0, doc2vec.similarity(vec.data(), vec.data()), 1e-4);
+  std::vector<long long> ids;
+  doc2vec.wvocab().searchWords(doc.m_words, ids);
+  doc2vec.sif_doc(ids.data(), ids.size(), ids_vec.data());
+  EXPECT_EQ(0, memcmp(vec.data(), ids_vec.data(), doc2vec.dim() * sizeof(real)));
+  doc2vec.vec_knn_docs(vec.data(), knn_items, K);
+  print_knns("遥感信息发展战略与对策");
+}
+
+TEST_F(TestSimilar, infer_cache) {
+  TaggedDocument doc({"光伏", "并网发电", "系统", "中", "逆变器", "的", "设计", "与", "控制", "方法", "</s>"});
+  std::vector<real> expected(doc2vec.dim()), vec(doc2vec.dim());
+  doc2vec.infer_doc(doc, expected.data());
+  doc2vec.setInferCache(100);
+  doc2vec.infer_doc(doc, vec.data());
+  doc2vec.infer_doc(doc, vec.data());
+  EXPECT_EQ(1ULL, doc2vec.inferCache()->misses());
+  EXPECT_EQ(1ULL, doc2vec.inferCache()->hits());
+  EXPECT_EQ(0, memcmp(expected.data(), vec.data(), doc2vec.dim() * sizeof(real)));
+  doc2vec.setInferCache(0);
+}
+
+TEST_F(TestSimilar, likelihoods) {
+  TaggedDocument docs[2] = {
+    TaggedDocument({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"}),
+    TaggedDocument({"新生儿", "败血症", "诊疗", "方案", "</s>"})
+  };
+  real doc_likelihoods[2];
+  doc2vec.doc_likelihoods(docs, 2, doc_likelihoods);
+  std::vector<real> positions(docs[0].m_words.size());
+  doc2vec.context_likelihoods(docs[0], positions.data());
+  for (int a = 0; a < 2; a++) EXPECT_FLOAT_EQ(doc2vec.doc_likelihood(docs[a]), doc_likelihoods[a]);
+  for (size_t a = 0; a < positions.size(); a++) EXPECT_FLOAT_EQ(doc2vec.context_likelihood(docs[0], a), positions[a]);
+}
+
+TEST_F(TestSimilar, keywords) {
+  TaggedDocument doc({"遥感信息", "水文", "动态", "模拟", "中", "应用", "水文", "</s>"});
+  std::vector<knn_item_t> knns = doc2vec.keywords(doc);
+  EXPECT_LE(knns.size(), 6);
+  for (size_t a = 0; a < knns.size(); a++) {
+    EXPECT_GE(knns[a].similarity, 0);
+    if (a > 0) {
+      EXPECT_GE(knns[a - 1].similarity, knns[a].similarity);
+    }
+    printf("%s %f\n", knns[a].word.c_str(), knns[a].similarity);
+  }
+}
+
+TEST_F(TestSimilar, wmd_weights) {
+  TaggedDocument query({"遥感信息", "水文", "动态", "模拟", "中", "应用", "</s>"});
+  EXPECT_GT(doc2vec.wvocab().getDocs(), 0);
+  for (auto weight : {WMD_WEIGHT_IDF, WMD_WEIGHT_SIF}) {
+    doc2vec.setWmdWeight(weight);
+    WeightedDocument weighted(&doc2vec, &query);
+    real sum = 0;
+    for (auto w : weighted.m_words_wei) sum += w;
+    EXPECT_NEAR(1, sum, 1e-5);
+    doc2vec.wmd().sent_knn_docs_ex(query, knn_items, K);
+    print_knns("遥感信息水文动态模拟中应用");
+  }
+  doc2vec.setWmdWeight(WMD_WEIGHT_LOO);
+}
+
+TEST_F(TestSimilar, batch_knn) {
+  const size_t q = 5;
+  std::vector<real> queries(doc2vec.nn().get_dsyn0norm(), doc2vec.nn().get_dsyn0norm() + q * doc2vec.dim());
+  std::vector<knn_hit_t> hits(q * K);
+  doc2vec.vecs_knn_docs(queries.data(), q, hits.data(), K);
+  for (size_t a = 0; a < q; a++) {
+    doc2vec.vec_knn_docs(&queries[a * doc2vec.dim()], knn_items, K);
+    EXPECT_EQ(a, hits[a * K].idx);
+    for (size_t b = 0; b < K; b++) {
+      EXPECT_NEAR(knn_items[b].similarity, hits[a * K + b].similarity, 1e-5);
+      if (b > 0) {
+        EXPECT_GE(hits[a * K + b - 1].similarity, hits[a * K + b].similarity);
+      }
+    }
+    EXPECT_EQ(knn_items[0].word, hits[a * K].word);
+  }
+}
+
+TEST_F(TestSimilar, int8_knn) {
+  const size_t q = 20;
+  std::vector<real> queries(doc2vec.nn().get_dsyn0norm(), doc2vec.nn().get_dsyn0norm() + q * doc2vec.dim());
+  std::vector<knn_hit_t> exact(q * K), hits(q * K);
+  doc2vec.vecs_knn_docs(queries.data(), q, exact.data(), K);
+  doc2vec.setInt8(true);
+  ASSERT_NE(doc2vec.nn().get_dsyn0q(), nullptr);
+  doc2vec.vecs_knn_docs(queries.data(), q, hits.data(), K);
+  size_t found = 0;
+  for (size_t a = 0; a < q; a++) {
+    EXPECT_EQ(a, hits[a * K].idx);
+    for (size_t b = 0; b < K; b++) {
+      if (b > 0) {
+        EXPECT_GE(hits[a * K + b - 1].similarity, hits[a * K + b].similarity);
+      }
+      for (size_t c = 0; c < K; c++) found += exact[a * K + c].idx == hits[a * K + b].idx;
+    }
+  }
+  EXPECT_GT(found, q * K * 95 / 100);
+  doc2vec.setInt8(false);
+}
+
+TEST_F(TestSimilar, pca_pruned_knn) {
+  const size_t q = 20;
+  std::vector<real> queries(doc2vec.nn().get_dsyn0norm(), doc2vec.nn().get_dsyn0norm() + q * doc2vec.dim());
+  std::vector<knn_hit_t> exact(q * K), hits(q * K);
+  doc2vec.vecs_knn_docs(queries.data(), q, exact.data(), K);
+  doc2vec.buildPca();
+  doc2vec.vecs_knn_docs(queries.data(), q, hits.data(), K);
+  for (size_t a = 0; a < q * K; a++) EXPECT_NEAR(exact[a].similarity, hits[a].similarity, 1e-5);
+  printf("dims read per query %f of %zu\n", doc2vec.docPca()->dimsRead(), doc2vec.dvocab().size() * doc2vec.dim());
+  EXPECT_LT(doc2vec.docPca()->dimsRead(), doc2vec.dvocab().size() * doc2vec.dim());
+  doc2vec.dropPca();
+}
+
+TEST_F(TestSimilar, filtered_knn) {
+  const real * queries = doc2vec.nn().get_dsyn0norm();
+  size_t docs = doc2vec.dvocab().size(), dim = doc2vec.dim();
+  std::vector<knn_hit_t> hits(K);
+  // one planned document by document(it may allow fewer than K), one scanned
+  for (size_t every : {1000, 3}) {
+    DocFilter filter(docs);
+    for (size_t a = 0; a < docs; a += every) filter.allow(a);
+    doc2vec.vecs_knn_docs(queries, 1, filter, hits.data(), K);
+    // the allowed hits come first, idx -1 pads the rest once the filter runs out
+    size_t found = std::min<size_t>(K, filter.count());
+    for (size_t b = 0; b < K; b++) {
+      if (b < found) {
+        EXPECT_TRUE(filter.allowed(hits[b].idx));
+      } else {
+        EXPECT_EQ(hits[b].idx, -1);
+      }
+    }
+    ASSERT_GT(found, 0u);
+    real worst = hits[found - 1].similarity;
+    for (auto idx : *filter.ids()) {
+      bool hit = std::any_of(hits.begin(), hits.begin() + found, [idx](const knn_hit_t & h) { return h.idx == idx; });
+      if (!hit) {
+        EXPECT_LE(dot(queries, queries + idx * dim, dim), worst + 1e-5);
+      }
+    }
+  }
+  auto tagged = doc2vec.tagFilter(doc2vec.dvocab().getWords()[1].word);
+  EXPECT_TRUE(tagged->allowed(1));
+  EXPECT_EQ(tagged, doc2vec.tagFilter(doc2vec.dvocab().getWords()[1].word));
+  doc2vec.doc_knn_docs(doc2vec.dvocab().getWords()[1].word, *tagged, knn_items, K);
+  // the query document itself is left out
+  size_t found = std::min<size_t>(K, tagged->count() - 1);
+  for (size_t b = 0; b < K; b++) {
+    if (b < found) {
+      EXPECT_TRUE(tagged->allowed(knn_items[b].idx));
+      EXPECT_NE(knn_items[b].idx, 1);
+    } else {
+      EXPECT_EQ(knn_items[b].idx, -1);
+    }
+  }
+}
+
+TEST_F(TestSimilar, hnsw_recall) {
+  const size_t q = 200;
+  auto & docs = doc2vec.dvocab().getWords();
+  std::vector<std::vector<long long>> exact(q);
+  for (size_t a = 0; a < q; a++) {
+    doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K);
+    for (size_t b = 0; b < K; b++) exact[a].push_back(knn_items[b].idx);
+  }
+  doc2vec.buildHnsw();
+  FILE * fout = fopen("../data/model.title.sg.hnsw", "wb");
+  doc2vec.saveHnsw(fout);
+  fclose(fout);
+  FILE * fin = fopen("../data/model.title.sg.hnsw", "rb");
+  doc2vec.loadHnsw(fin);
+  fclose(fin);
+  for (size_t ef : {16, 64, 256}) {
+    size_t found = 0;
+    search_params_t params;
+    params.hnsw_ef = ef;
+    for (size_t a = 0; a < q; a++) {
+      doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K, params);
+      for (size_t b = 0; b < K; b++) found += std::count(exact[a].begin(), exact[a].end(), knn_items[b].idx);
+    }
+    printf("ef %zu recall@%d %f\n", ef, K, found / (double)(q * K));
+    if (ef >= 64) {
+      EXPECT_GT(found, q * K * 9 / 10);
+    }
+  }
+  doc2vec.dropHnsw();
+}
+
+TEST_F(TestSimilar, ivf_recall) {
+  const size_t q = 200;
+  auto & docs = doc2vec.dvocab().getWords();
+  std::vector<std::vector<long long>> exact(q);
+  for (size_t a = 0; a < q; a++) {
+    doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K);
+    for (size_t b = 0; b < K; b++) exact[a].push_back(knn_items[b].idx);
+  }
+  doc2vec.buildIvf();
+  FILE * fout = fopen("../data/model.title.sg.ivf", "wb");
+  doc2vec.saveIvf(fout);
+  fclose(fout);
+  FILE * fin = fopen("../data/model.title.sg.ivf", "rb");
+  doc2vec.loadIvf(fin);
+  fclose(fin);
+  for (size_t nprobe : {1, 8, 32}) {
+    size_t found = 0;
+    search_params_t params;
+    params.ivf_probes = nprobe;
+    for (size_t a = 0; a < q; a++) {
+      doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K, params);
+      for (size_t b = 0; b < K; b++) found += std::count(exact[a].begin(), exact[a].end(), knn_items[b].idx);
+    }
+    printf("nprobe %zu recall@%d %f\n", nprobe, K, found / (double)(q * K));
+    if (nprobe >= 32) {
+      EXPECT_GT(found, q * K * 9 / 10);
+    }
+  }
+  doc2vec.dropIvf();
+}
+
+TEST_F(TestSimilar, binary_recall) {
+  const size_t q = 200;
+  auto & docs = doc2vec.dvocab().getWords();
+  std::vector<std::vector<long long>> exact(q);
+  for (size_t a = 0; a < q; a++) {
+    doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K);
+    for (size_t b = 0; b < K; b++) exact[a].push_back(knn_items[b].idx);
+  }
+  doc2vec.buildBinary(true);
+  FILE * fout = fopen("../data/model.title.sg.bits", "wb");
+  doc2vec.saveBinary(fout);
+  fclose(fout);
+  FILE * fin = fopen("../data/model.title.sg.bits", "rb");
+  doc2vec.loadBinary(fin);
+  fclose(fin);
+  for (size_t rerank : {50, 200, 1000}) {
+    size_t found = 0;
+    search_params_t params;
+    params.binary_rerank = rerank;
+    for (size_t a = 0; a < q; a++) {
+      doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K, params);
+      for (size_t b = 0; b < K; b++) found += std::count(exact[a].begin(), exact[a].end(), knn_items[b].idx);
+    }
+    printf("rerank %zu recall@%d %f\n", rerank, K, found / (double)(q * K));
+    if (rerank >= 1000) {
+      EXPECT_GT(found, q * K * 7 / 10);
+    }
+  }
+  doc2vec.dropBinary();
+}
+
+TEST_F(TestSimilar, pq_compact) {
+  const size_t q = 200;
+  auto & docs = doc2vec.dvocab().getWords();
+  std::vector<std::vector<long long>> exact(q);
+  for (size_t a = 0; a < q; a++) {
+    doc2vec.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K);
+    for (size_t b = 0; b < K; b++) exact[a].push_back(knn_items[b].idx);
+  }
+  doc2vec.buildPq(doc2vec.dim() / 4);
+  FILE * fout = fopen("../data/model.title.sg.pq", "wb");
+  doc2vec.savePq(fout);
+  fclose(fout);
+  doc2vec.dropPq();
+  // serve from the codes, the document vectors stay in the model file
+  Model compact;
+  FILE * fin = fopen("../data/model.title.sg", "rb");
+  FILE * fpq = fopen("../data/model.title.sg.pq", "rb");
+  compact.load(fin, fpq);
+  fclose(fin);
+  fclose(fpq);
+  EXPECT_EQ(compact.nn().get_dsyn0norm(), nullptr);
+  for (size_t rerank : {0, 100}) {
+    compact.setPqRerank(rerank);
+    size_t found = 0;
+    for (size_t a = 0; a < q; a++) {
+      compact.doc_knn_docs(docs[a * 7 % docs.size()].word, knn_items, K);
+      for (size_t b = 0; b < K; b++) found += std::count(exact[a].begin(), exact[a].end(), knn_items[b].idx);
+    }
+    printf("rerank %zu recall@%d %f\n", rerank, K, found / (double)(q * K));
+    if (rerank > 0) {
+      EXPECT_GT(found, q * K * 8 / 10);
+    }
+  }
+}
+
 void buildDoc(TaggedDocument * doc, ...)
 {
   doc->clear();
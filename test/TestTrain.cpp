@@ -1,4 +1,6 @@
 #include <limits>
+#include <algorithm>
+#include <cmath>
 #include "gtest/gtest.h"
 #include <Model.h>
 #include <common_define.h>
@@ -12,3 +14,176 @@ TEST(TestTrain, title_sg) {
   doc2vec.save(fout);
   fclose(fout);
 }
+
+TEST(TestTrain, title_dbow) {
+  doc2vec::Model doc2vec;
+  doc2vec::FileInput input("../data/paper.title.seg");
+  doc2vec.train(input, 50, 0, 1, 0, 15, 10, 0.025, 1e-5, 3, 6, false);
+  EXPECT_GT(doc2vec.dvocab().size(), 1u);
+  FILE * fout = fopen("../data/model.title.dbow", "wb");
+  doc2vec.save(fout);
+  fclose(fout);
+  // the reloaded model still knows its word vectors never trained
+  doc2vec::Model reloaded;
+  FILE * fin = fopen("../data/model.title.dbow", "rb");
+  reloaded.load(fin);
+  fclose(fin);
+  doc2vec::knn_item_t knns[10];
+  EXPECT_FALSE(reloaded.word_knn_words(reloaded.wvocab().getWords()[1].word, knns, 10));
+  doc2vec::TaggedDocument query({reloaded.wvocab().getWords()[1].word, "</s>"});
+  EXPECT_FALSE(reloaded.wmd().sent_knn_docs(query, knns, 10));
+  std::vector<real> vec(reloaded.dim());
+  EXPECT_FALSE(reloaded.sif_doc(query, vec.data()));
+  // the document queries still work
+  EXPECT_TRUE(reloaded.doc_knn_docs(reloaded.dvocab().getWords()[1].word, knns, 10));
+}
+
+TEST(TestTrain, title_sg_warm_start) {
+  doc2vec::Model base;
+  FILE * fin = fopen("../data/model.title.sg", "rb");
+  base.load(fin);
+  fclose(fin);
+  doc2vec::Model doc2vec;
+  doc2vec::FileInput input("../data/paper.title.seg");
+  doc2vec.train(input, base, true, 5, 0.025, 6);
+  EXPECT_EQ(doc2vec.wvocab().size(), base.wvocab().size());
+  EXPECT_EQ(0, memcmp(doc2vec.nn().get_syn0(), base.nn().get_syn0(),
+		      base.wvocab().size() * base.dim() * sizeof(real)));
+}
+
+// rows of vectors moved out of the box of their random initialization(|x| <= 0.5 / dim)
+static size_t trainedRows(const real * vectors, size_t rows, size_t dim)
+{
+  size_t trained = 0;
+  for (size_t a = 0; a < rows; a++) {
+    trained += std::any_of(vectors + a * dim, vectors + (a + 1) * dim, [dim](real x) { return fabs(x) > 0.5 / dim; });
+  }
+  return trained;
+}
+
+TEST(TestTrain, title_sg_processes) {
+  doc2vec::Model doc2vec;
+  doc2vec::FileInput input("../data/paper.title.seg");
+  doc2vec.setProcesses(3);
+  doc2vec.train(input, 50, 0, 1, 0, 15, 10, 0.025, 1e-5, 3, 2);
+  // the averaged words and every partition's documents came back from the processes
+  size_t words = doc2vec.wvocab().size(), docs = doc2vec.dvocab().size(), dim = doc2vec.dim();
+  EXPECT_GT(trainedRows(doc2vec.nn().get_syn0() + dim, words - 1, dim), (words - 1) * 9 / 10);
+  EXPECT_GT(trainedRows(doc2vec.nn().get_dsyn0(), docs, dim), docs * 9 / 10);
+  FILE * fout = fopen("../data/model.title.sg.processes", "wb");
+  doc2vec.save(fout);
+  fclose(fout);
+  doc2vec::Model loaded;
+  FILE * fin = fopen("../data/model.title.sg.processes", "rb");
+  loaded.load(fin);
+  fclose(fin);
+  ASSERT_EQ(loaded.dvocab().size(), docs);
+  EXPECT_EQ(0, memcmp(doc2vec.nn().get_syn0(), loaded.nn().get_syn0(), words * dim * sizeof(real)));
+  EXPECT_EQ(0, memcmp(doc2vec.nn().get_dsyn0(), loaded.nn().get_dsyn0(), docs * dim * sizeof(real)));
+  // the frequent words share their neighbours with the single process model far above chance, about
+  // as often as two single process runs do
+  doc2vec::Model single;
+  fin = fopen("../data/model.title.sg", "rb");
+  ASSERT_TRUE(fin != NULL);
+  single.load(fin);
+  fclose(fin);
+  const size_t q = 50, k = 10;
+  doc2vec::knn_item_t a[k], b[k];
+  size_t shared = 0;
+  for (size_t w = 1; w <= q; w++) {
+    auto & word = loaded.wvocab().getWords()[w].word;
+    ASSERT_TRUE(loaded.word_knn_words(word, a, k));
+    ASSERT_TRUE(single.word_knn_words(word, b, k));
+    for (size_t x = 0; x < k; x++) {
+      shared += std::any_of(b, b + k, [&](const doc2vec::knn_item_t & y) { return y.word == a[x].word; });
+    }
+  }
+  EXPECT_GT(shared, std::max(q * k / 10, 2 * q * k * k / words));
+}
+
+TEST(TestTrain, title_sg_resume) {
+  doc2vec::Model doc2vec;
+  doc2vec::FileInput input("../data/paper.title.seg");
+  // the checkpoint of epoch 3 is the last one, patience outlasts the 5 epochs
+  doc2vec.setCheckpoint("../data/model.title.sg.checkpoint", 3);
+  doc2vec.setEarlyStopping(0.1, 10);
+  doc2vec.train(input, 50, 0, 1, 0, 5, 10, 0.025, 1e-5, 3, 6);
+  ASSERT_EQ(doc2vec.epochsDone(), 5);
+  ASSERT_EQ(doc2vec.epochLog().size(), 5u);
+  doc2vec::Model resumed;
+  // replaced by the early stopping settings of the checkpoint
+  resumed.setEarlyStopping(0.5, 1);
+  FILE * fin = fopen("../data/model.title.sg.checkpoint", "rb");
+  ASSERT_TRUE(fin != NULL);
+  resumed.resume(input, fin);
+  fclose(fin);
+  EXPECT_EQ(resumed.dvocab().size(), doc2vec.dvocab().size());
+  EXPECT_EQ(resumed.holdoutEvery(), doc2vec.holdoutEvery());
+  EXPECT_EQ(resumed.patience(), doc2vec.patience());
+  // continues after epoch 3 on the lr schedule of the uninterrupted run and ends with it
+  EXPECT_EQ(resumed.epochsDone(), doc2vec.epochsDone());
+  ASSERT_EQ(resumed.epochLog().size(), 2u);
+  for (size_t a = 0; a < 2; a++) {
+    auto & run = doc2vec.epochLog()[a + 3];
+    EXPECT_EQ(resumed.epochLog()[a].epoch, run.epoch);
+    EXPECT_NEAR(resumed.epochLog()[a].alpha, run.alpha, 1e-6);
+  }
+}
+
+TEST(TestTrain, title_sg_early_stopping) {
+  // with an lr this small the held-out likelihood can't improve by 0.1% after the first epoch
+  doc2vec::Model doc2vec;
+  doc2vec::FileInput input("../data/paper.title.seg");
+  doc2vec.setEarlyStopping(0.01, 1);
+  doc2vec.train(input, 50, 0, 1, 0, 15, 10, 1e-6, 1e-5, 3, 6);
+  EXPECT_GT(doc2vec.dvocab().size(), 1u);
+  // the second epoch is the bad one, the lr anneals over a third
+  EXPECT_EQ(doc2vec.epochsDone(), 3);
+  ASSERT_EQ(doc2vec.epochLog().size(), 3u);
+  auto & log = doc2vec.epochLog();
+  EXPECT_LT(log[1].holdout_likelihood, log[0].holdout_likelihood + fabs(log[0].holdout_likelihood) * 1e-3);
+  for (auto & epoch : log) EXPECT_LT(epoch.holdout_likelihood, 0);
+  // patience beyond iter never stops
+  doc2vec::Model patient;
+  patient.setEarlyStopping(0.01, 15);
+  patient.train(input, 50, 0, 1, 0, 15, 10, 1e-6, 1e-5, 3, 6);
+  EXPECT_EQ(patient.epochsDone(), 15);
+  ASSERT_EQ(patient.epochLog().size(), 15u);
+  for (auto & epoch : patient.epochLog()) EXPECT_LT(epoch.holdout_likelihood, 0);
+}
+
+TEST(TestTrain, title_sg_add_documents) {
+  doc2vec::Model doc2vec;
+  FILE * fin = fopen("../data/model.title.sg", "rb");
+  doc2vec.load(fin);
+  fclose(fin);
+  size_t docs = doc2vec.dvocab().size();
+  long long counted = doc2vec.wvocab().getDocs();
+  const char data[] = "_*new_1 遥感信息 发展战略 与 对策\n_*new_2 新生儿 败血症 诊疗 方案\n";
+  doc2vec::MemoryInput input(sizeof(data) - 1, data);
+  doc2vec.add_documents(input, 2);
+  EXPECT_EQ(docs + 2, doc2vec.dvocab().size());
+  EXPECT_EQ(counted + 2, doc2vec.wvocab().getDocs());
+  FILE * fout = fopen("../data/model.title.sg.added", "wb");
+  doc2vec.save(fout);
+  fclose(fout);
+  doc2vec::Model loaded;
+  fin = fopen("../data/model.title.sg.added", "rb");
+  loaded.load(fin);
+  fclose(fin);
+  EXPECT_EQ(docs + 2, loaded.dvocab().size());
+  EXPECT_EQ(0, memcmp(doc2vec.nn().get_dsyn0(), loaded.nn().get_dsyn0(), (docs + 2) * loaded.dim() * sizeof(real)));
+}
+
+TEST(TestTrain, title_ns_continue_train) {
+  doc2vec::Model doc2vec;
+  doc2vec::FileInput input("../data/paper.title.seg");
+  doc2vec.train(input, 50, 0, 0, 5, 5, 10, 0.025, 1e-5, 3, 6);
+  size_t words = doc2vec.wvocab().size();
+  const char data[] = "_*new_1 新词 遥感信息 发展战略\n_*new_2 新词 遥感信息 水文\n_*new_3 新词 遥感信息 应用\n";
+  doc2vec::MemoryInput more(sizeof(data) - 1, data);
+  doc2vec.continue_train(more, 3, 2);
+  EXPECT_EQ(words + 1, doc2vec.wvocab().size());
+  EXPECT_LT(0, doc2vec.wvocab().searchVocab("新词"));
+  EXPECT_EQ(3u, doc2vec.wvocab().getWords()[doc2vec.wvocab().searchVocab("新词")].df);
+}